@@ -0,0 +1,281 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "assoofs.h"
+
+/*
+ *  Reproduce una traza de assoofs (montaje con -o trace) sobre otro punto de montaje, normalmente una imagen recien
+ *  creada con mkassoofs, y mide la latencia de cada operacion.
+ *  Los inodos de la traza se traducen a rutas: la raiz es el punto de montaje y cada lookup, create o mkdir que
+ *  devuelve un inodo le da su ruta. Las operaciones sobre inodos que la traza no llega a nombrar se saltan.
+ *  Los nombres mas largos que ASSOOFS_TRACE_NAME_LEN llegan recortados y se rellenan con '~' hasta su longitud real, asi el
+ *  mismo (directorio, nombre recortado, longitud) da siempre el mismo fichero.
+ */
+
+#define OPS (ASSOOFS_TRACE_ITERATE + 1)
+#define MAX_INODE_NO 64 /* ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED, que es const int y no sirve como tam de un array */
+
+static const char *op_names[OPS] = {
+    [ASSOOFS_TRACE_LOOKUP] = "lookup",
+    [ASSOOFS_TRACE_CREATE] = "create",
+    [ASSOOFS_TRACE_MKDIR] = "mkdir",
+    [ASSOOFS_TRACE_READ] = "read",
+    [ASSOOFS_TRACE_WRITE] = "write",
+    [ASSOOFS_TRACE_ITERATE] = "iterate",
+};
+
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+};
+
+struct replay_state {
+    char *paths[MAX_INODE_NO + 1];  // Ruta de cada inodo de la traza
+    int fds[MAX_INODE_NO + 1];      // Ficheros ya abiertos, para no medir el open en cada read/write
+    char *buf;                                                  // Datos para read/write
+    size_t buf_size;
+    struct op_stats stats[OPS];
+    uint64_t skipped;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int valid_ino(uint64_t ino) {
+    return ino > 0 && ino <= MAX_INODE_NO;
+}
+
+/* El inodo ino pasa a llamarse path; si tenia un fichero abierto era de otro objeto con el mismo numero */
+static void set_path(struct replay_state *st, uint64_t ino, char *path) {
+    if (st->fds[ino] != -1) {
+        close(st->fds[ino]);
+        st->fds[ino] = -1;
+    }
+    free(st->paths[ino]);
+    st->paths[ino] = path;
+}
+
+static char *child_path(struct replay_state *st, const struct assoofs_trace_record *rec) {
+    int name_len = rec->name_len, kept;
+    size_t len, parent_len;
+    char *path;
+
+    if (!valid_ino(rec->parent) || st->paths[rec->parent] == NULL || name_len == 0 || name_len > ASSOOFS_FILENAME_MAXLEN)
+        return NULL;
+    kept = name_len < ASSOOFS_TRACE_NAME_LEN ? name_len : ASSOOFS_TRACE_NAME_LEN;
+    parent_len = strlen(st->paths[rec->parent]);
+    len = parent_len + name_len + 2;
+    path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%.*s", st->paths[rec->parent], kept, rec->name);
+        memset(path + parent_len + 1 + kept, '~', name_len - kept); // Lo que la traza no guardo del nombre
+        path[len - 1] = '\0';
+    }
+    return path;
+}
+
+static int get_fd(struct replay_state *st, uint64_t ino) {
+    if (st->fds[ino] == -1)
+        st->fds[ino] = open(st->paths[ino], O_RDWR);
+    return st->fds[ino];
+}
+
+static int grow_buffer(struct replay_state *st, size_t len) {
+    char *buf;
+
+    if (len <= st->buf_size)
+        return 0;
+    buf = realloc(st->buf, len);
+    if (buf == NULL)
+        return -1;
+    memset(buf + st->buf_size, 'a', len - st->buf_size);
+    st->buf = buf;
+    st->buf_size = len;
+    return 0;
+}
+
+/* Ejecuta un registro y devuelve 0 si la operacion fue bien, -1 si fallo y 1 si no se puede reproducir */
+static int replay_one(struct replay_state *st, const struct assoofs_trace_record *rec) {
+    struct stat stat_buf;
+    struct dirent *dirent;
+    char *path = NULL;
+    DIR *dir;
+    int fd, ret = 0;
+
+    switch (rec->op) {
+    case ASSOOFS_TRACE_LOOKUP:
+    case ASSOOFS_TRACE_CREATE:
+    case ASSOOFS_TRACE_MKDIR:
+        path = child_path(st, rec);
+        if (path == NULL)
+            return 1;
+        if (rec->op == ASSOOFS_TRACE_LOOKUP)
+            ret = stat(path, &stat_buf);
+        else if (rec->op == ASSOOFS_TRACE_MKDIR)
+            ret = mkdir(path, 0755);
+        else if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1)
+            ret = -1;
+        else
+            close(fd);
+        /* Si en la traza el lookup no encontro nada, que aqui tampoco exista es lo esperado */
+        if (ret && rec->op == ASSOOFS_TRACE_LOOKUP && rec->ino == 0 && errno == ENOENT)
+            ret = 0;
+        /* Un lookup sin resultado no da nombre a nada, pero se ha ejecutado igual */
+        if (valid_ino(rec->ino))
+            set_path(st, rec->ino, path);
+        else
+            free(path);
+        return ret ? -1 : 0;
+
+    case ASSOOFS_TRACE_READ:
+    case ASSOOFS_TRACE_WRITE:
+        if (!valid_ino(rec->ino) || st->paths[rec->ino] == NULL || grow_buffer(st, rec->len))
+            return 1;
+        fd = get_fd(st, rec->ino);
+        if (fd == -1)
+            return -1;
+        if (rec->op == ASSOOFS_TRACE_READ)
+            return pread(fd, st->buf, rec->len, rec->offset) == -1 ? -1 : 0;
+        return pwrite(fd, st->buf, rec->len, rec->offset) == -1 ? -1 : 0;
+
+    case ASSOOFS_TRACE_ITERATE:
+        if (!valid_ino(rec->ino) || st->paths[rec->ino] == NULL)
+            return 1;
+        dir = opendir(st->paths[rec->ino]);
+        if (dir == NULL)
+            return -1;
+        do {
+            dirent = readdir(dir);
+        } while (dirent != NULL);
+        closedir(dir);
+        return 0;
+
+    default:
+        return 1;
+    }
+}
+
+static void print_stats(struct replay_state *st, uint64_t elapsed_ns) {
+    struct op_stats *s;
+    int op;
+
+    printf("%-8s %10s %8s %12s %12s %12s\n", "op", "count", "errors", "avg (us)", "min (us)", "max (us)");
+    for (op = 1; op < OPS; op++) {
+        s = &st->stats[op];
+        if (s->count == 0)
+            continue;
+        printf("%-8s %10llu %8llu %12.1f %12.1f %12.1f\n", op_names[op], (unsigned long long)s->count,
+               (unsigned long long)s->errors, s->total_ns / 1000.0 / s->count, s->min_ns / 1000.0, s->max_ns / 1000.0);
+    }
+    printf("%llu records skipped (inode unknown to the trace), %.3f s total.\n",
+           (unsigned long long)st->skipped, elapsed_ns / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_state st;
+    struct assoofs_trace_record rec;
+    struct op_stats *s;
+    uint64_t start, first = 0, begin, latency;
+    int opt, fast = 0, started = 0, ret, i;
+    ssize_t nbytes;
+    FILE *trace;
+
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        switch (opt) {
+        case 'f':
+            fast = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 2) {
+        printf("Usage: assoofs-replay [-f] <trace> <mountpoint>\n");
+        printf("  Replays a trace read from /sys/kernel/debug/assoofs/<device>/trace.\n");
+        printf("  -f  as fast as possible instead of with the original timing\n");
+        return 1;
+    }
+
+    trace = fopen(argv[optind], "r");
+    if (trace == NULL) {
+        perror("Error opening the trace");
+        return 1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    for (i = 0; i <= MAX_INODE_NO; i++)
+        st.fds[i] = -1;
+    st.paths[ASSOOFS_ROOTDIR_INODE_NUMBER] = strdup(argv[optind + 1]);
+
+    start = now_ns();
+    while ((nbytes = fread(&rec, 1, sizeof(rec), trace)) == sizeof(rec)) {
+        if (rec.op == 0 || rec.op >= OPS) {
+            st.skipped++;
+            continue;
+        }
+
+        /* Con la temporizacion original cada operacion espera a su instante, relativo al primer registro */
+        if (!started) {
+            first = rec.time_ns;
+            started = 1;
+        }
+        if (!fast && rec.time_ns > first)
+            sleep_until(start + (rec.time_ns - first));
+
+        begin = now_ns();
+        ret = replay_one(&st, &rec);
+        latency = now_ns() - begin;
+        if (ret > 0) {
+            st.skipped++;
+            continue;
+        }
+
+        s = &st.stats[rec.op];
+        if (s->count == 0 || latency < s->min_ns)
+            s->min_ns = latency;
+        if (latency > s->max_ns)
+            s->max_ns = latency;
+        s->total_ns += latency;
+        s->count++;
+        if (ret < 0)
+            s->errors++;
+    }
+    if (nbytes != 0)
+        printf("The trace ends with a partial record, ignored.\n");
+    fclose(trace);
+
+    print_stats(&st, now_ns() - start);
+
+    for (i = 0; i <= MAX_INODE_NO; i++) {
+        if (st.fds[i] != -1)
+            close(st.fds[i]);
+        free(st.paths[i]);
+    }
+    free(st.buf);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "assoofs.h"
+
+/*
+ *  Crecimiento en caliente de un assoofs montado.
+ *  Primero se amplia el dispositivo (truncate + losetup -c en imagenes loop) y despues se ejecuta sobre el punto de montaje.
+ */
+int main(int argc, char *argv[])
+{
+    uint64_t blocks_count = 0; // 0 = todo el dispositivo
+    int fd;
+
+    if (argc != 2 && argc != 3) {
+        printf("Usage: assoofs-resize <mountpoint> [blocks]\n");
+        printf("  Grows a mounted assoofs to [blocks] blocks, or to the whole device if omitted.\n");
+        return 1;
+    }
+    if (argc == 3) {
+        blocks_count = strtoull(argv[2], NULL, 0);
+        if (blocks_count == 0) {
+            printf("Invalid block count '%s'.\n", argv[2]);
+            return 1;
+        }
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening the mountpoint");
+        return 1;
+    }
+
+    if (ioctl(fd, ASSOOFS_IOC_GROW, &blocks_count) == -1) {
+        perror("Error growing the filesystem");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("The filesystem now has %llu blocks.\n", (unsigned long long)blocks_count);
+    return 0;
+}
@@ -3,43 +3,564 @@
 #include <linux/init.h>         /* Needed for the macros */
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
+#include <linux/blkdev.h>       /* Dispositivos del stripe */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/falloc.h>       /* FALLOC_FL_*           */
+#include <linux/mount.h>        /* mnt_want_write_file   */
+#include <linux/uaccess.h>      /* get_user, put_user    */
+#include <linux/debugfs.h>      /* Fichero de la traza   */
+#include <linux/vmalloc.h>      /* Anillo de la traza    */
+#include <linux/ktime.h>        /* ktime_get_ns          */
+#include <linux/crc32c.h>       /* Sumas de los metadatos */
 #include "assoofs.h"
 
+/* Informacion del superbloque en memoria (s_fs_info) */
+struct assoofs_sb_info {
+	struct buffer_head *sbh;                // Bloque 0, se mantiene en memoria mientras este montado
+	struct assoofs_super_block_info *disk;  // Informacion persistente (apunta dentro de sbh)
+	uint64_t dir_records_per_block;          // Capacidades que dependen de block_size, se calculan al montar
+	uint64_t max_inodes;
+	int blockmap;                            // Los ficheros tienen mapa de bloques (ASSOOFS_BLOCKMAP_VERSION)
+	uint64_t blocks_per_file;                // Entradas del mapa, o 1 en imagenes sin mapa
+	uint64_t blocks_count;                   // Tam del volumen en bloques, crece con ASSOOFS_IOC_GROW
+	struct assoofs_trace *trace;             // Solo con la opcion de montaje trace
+	struct block_device *members[ASSOOFS_MAX_STRIPE_DEVICES]; // Dispositivos del volumen, members[0] es sb->s_bdev
+	int nr_members;
+	fmode_t member_mode;                     // Modo con el que se abrieron members[1..]
+	uint64_t stripe_unit;
+	int checksums;                           // Los metadatos llevan crc32c (ASSOOFS_CHECKSUM_VERSION)
+	int bitmap;                              // Mapa de bits en bloques propios (ASSOOFS_BITMAP_VERSION), si no free_blocks
+	uint64_t bitmap_bits;                    // Bloques que cubre cada bloque del mapa de bits
+	uint64_t bitmap_dirty_first;             // Bloques del mapa de bits tocados desde la ultima sincronizacion,
+	uint64_t bitmap_dirty_last;              // [first, last). Con assoofs_sb_lock
+	struct list_head prealloc;               // Inodos con tira reservada (assoofs_inode.prealloc_list). Con assoofs_sb_lock
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb) {
+	return sb->s_fs_info;
+}
+
+/* Inodo en memoria (i_private): la parte persistente va primero, el resto del codigo la usa como assoofs_inode_info */
+struct assoofs_inode {
+	struct assoofs_inode_info info;
+	uint64_t prealloc_start;                 // Bloques apartados en memoria para las siguientes escrituras del fichero,
+	uint64_t prealloc_end;                   // [prealloc_start, prealloc_end). Siguen libres en el mapa de bits
+	struct list_head prealloc_list;          // En sbi->prealloc mientras prealloc_start < prealloc_end. Con assoofs_sb_lock
+};
+
+static inline struct assoofs_inode *ASSOOFS_I(struct assoofs_inode_info *info) {
+	return container_of(info, struct assoofs_inode, info);
+}
+
+/* Traduce un bloque logico a su dispositivo y bloque fisico (ASSOOFS_STRIPE_OFFSET) */
+static struct block_device *assoofs_map_stripe(struct super_block *sb, uint64_t block, sector_t *phys) {
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	if (sbi->nr_members <= 1) {
+		*phys = block;
+		return sb->s_bdev;
+	}
+	*phys = ASSOOFS_STRIPE_OFFSET(block, sbi->stripe_unit, sbi->nr_members);
+	return sbi->members[ASSOOFS_STRIPE_MEMBER(block, sbi->stripe_unit, sbi->nr_members)];
+}
+
+/* sb_bread y sb_getblk por bloque logico: todas las lecturas de bloques pasan por aqui salvo la del superbloque al montar */
+static struct buffer_head *assoofs_bread(struct super_block *sb, uint64_t block) {
+	sector_t phys;
+	struct block_device *bdev = assoofs_map_stripe(sb, block, &phys);
+
+	return __bread(bdev, phys, sb->s_blocksize);
+}
+
+static struct buffer_head *assoofs_getblk(struct super_block *sb, uint64_t block) {
+	sector_t phys;
+	struct block_device *bdev = assoofs_map_stripe(sb, block, &phys);
+
+	return __getblk(bdev, phys, sb->s_blocksize);
+}
+
+/*
+ * Sumas de los bloques de metadatos. Se comprueban una sola vez por lectura de disco: el buffer queda marcado como
+ * verificado y mientras siga en memoria las siguientes lecturas solo miran ese bit.
+ */
+enum assoofs_bh_state_bits {
+	BH_Verified = BH_PrivateStart,
+};
+BUFFER_FNS(Verified, verified)
+
+static int assoofs_checksum_ok(unsigned long block_size, const void *data) {
+	return crc32c(~0U, data, ASSOOFS_CHECKSUM_OFFSET(block_size)) == *(const uint32_t *)(data + ASSOOFS_CHECKSUM_OFFSET(block_size));
+}
+
+/* assoofs_bread para metadatos: si el bloque viene de disco se comprueba su suma */
+static struct buffer_head *assoofs_bread_meta(struct super_block *sb, uint64_t block) {
+	struct buffer_head *bh = assoofs_getblk(sb, block);
+
+	if (!bh)
+		return NULL;
+	if (!buffer_uptodate(bh)) {
+		lock_buffer(bh);
+		if (!buffer_uptodate(bh))
+			clear_buffer_verified(bh); // Lo que se verifico antes ya no esta en memoria
+		if (bh_submit_read(bh)) {
+			brelse(bh);
+			return NULL;
+		}
+	}
+
+	/* Se suma con el buffer bloqueado: los cambios se hacen igual (assoofs_meta_unlock_dirty) y no se ve uno a medias */
+	if (ASSOOFS_SB(sb)->checksums && !buffer_verified(bh)) {
+		lock_buffer(bh);
+		if (!buffer_verified(bh)) { // Otro lo puede haber verificado mientras se esperaba el bloqueo
+			if (!assoofs_checksum_ok(sb->s_blocksize, bh->b_data)) {
+				unlock_buffer(bh);
+				printk(KERN_ERR "assoofs checksum mismatch in block %llu.\n", block);
+				brelse(bh);
+				return NULL; // Quien llama lo trata como un error de E/S
+			}
+			set_buffer_verified(bh);
+		}
+		unlock_buffer(bh);
+	}
+	return bh;
+}
+
+/*
+ * Los bloques de metadatos se cambian con lock_buffer(), como en ext4: el writeback tambien bloquea el buffer para
+ * escribirlo, asi nunca sale a disco un bloque con el cambio hecho y la suma vieja. Se llama con el buffer bloqueado
+ * tras el cambio: recalcula la suma, lo suelta y lo marca como sucio.
+ */
+static void assoofs_meta_unlock_dirty(struct super_block *sb, struct buffer_head *bh) {
+	if (ASSOOFS_SB(sb)->checksums)
+		*(uint32_t *)(bh->b_data + ASSOOFS_CHECKSUM_OFFSET(sb->s_blocksize)) = crc32c(~0U, bh->b_data, ASSOOFS_CHECKSUM_OFFSET(sb->s_blocksize));
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+}
+
+/* Bloques por tanda en read y write: se piden todos antes de esperar a ninguno, asi se reparten entre los dispositivos */
+#define ASSOOFS_IO_BATCH 16
+
 /* Definicion de MUTEX (Parte opcional) */
 static DEFINE_MUTEX(assoofs_sb_lock);
 static DEFINE_MUTEX(assoofs_inodestore_lock);
 
 /* Definicion de cache de inodos y funcion nueva para destruir inodos (Parte opcional) */
 static struct kmem_cache *assoofs_inode_cache;
-int assoofs_destroy_inode(struct inode *inode);
-
-int assoofs_destroy_inode(struct inode *inode) {
-	struct assoofs_inode *inode_info = inode->i_private;
-	printk(KERN_INFO "Freeing private data of inode %p ( %lu).\n", inode_info, inode->i_ino);
-	kmem_cache_free(assoofs_inode_cache, inode_info);
-	return 0;
-}
+void assoofs_evict_inode(struct inode *inode);
 
 /*
 * Operaciones auxiliares 
 */
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block);
+int assoofs_sb_get_free_blocks(struct super_block *sb, uint64_t goal, uint64_t max, uint64_t *block, struct assoofs_inode *reserve);
+int assoofs_sb_take_reserved_block(struct super_block *sb, struct assoofs_inode *ai, uint64_t *block);
+void assoofs_zero_block(struct super_block *sb, uint64_t block, int meta);
+int assoofs_alloc_zeroed_block(struct super_block *sb, uint64_t goal, uint64_t *block, int meta);
+int assoofs_alloc_data_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t goal);
+int assoofs_sb_get_a_freeinode(struct super_block *sb, struct assoofs_inode_info *store, uint64_t *inode_no);
+void assoofs_sb_free_block(struct super_block *sb, uint64_t block);
 void assoofs_save_sb_info(struct super_block *vsb);
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
+void assoofs_remove_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+void assoofs_dirty_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+int assoofs_add_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name, uint64_t inode_no);
+int assoofs_remove_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name);
+int assoofs_set_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name, uint64_t inode_no);
+
+/*
+ *  Traza de operaciones (opcion de montaje trace)
+ *  Un montaje con -o trace guarda sus ultimas ASSOOFS_TRACE_RECORDS operaciones en un anillo que se lee en
+ *  /sys/kernel/debug/assoofs/<dispositivo>/trace. assoofs-replay las vuelve a ejecutar sobre otra imagen.
+ */
+#define ASSOOFS_TRACE_RECORDS 4096 // Potencia de 2
+
+struct assoofs_trace {
+	spinlock_t lock;
+	uint64_t seq;                          // Registros escritos desde el montaje, el siguiente va en seq % ASSOOFS_TRACE_RECORDS
+	u64 start;                             // Instante del montaje, los tiempos de la traza son relativos a el
+	struct dentry *dir;                    // Directorio del montaje en debugfs
+	struct assoofs_trace_record *ring;
+};
+
+static struct dentry *assoofs_debugfs_root;
+
+static void assoofs_trace(struct super_block *sb, uint16_t op, uint64_t ino, uint64_t parent, uint64_t offset, uint32_t len, const struct qstr *name) {
+	struct assoofs_trace *trace = ASSOOFS_SB(sb)->trace;
+	struct assoofs_trace_record *rec;
+
+	if (!trace)
+		return; // Sin -o trace solo cuesta esta comprobacion
+
+	spin_lock(&trace->lock);
+	rec = &trace->ring[trace->seq % ASSOOFS_TRACE_RECORDS]; // Si esta lleno se pisa el mas antiguo
+	rec->time_ns = ktime_get_ns() - trace->start;
+	rec->ino = ino;
+	rec->parent = parent;
+	rec->offset = offset;
+	rec->len = len;
+	rec->op = op;
+	rec->name_len = name ? name->len : 0;
+	memset(rec->name, 0, sizeof(rec->name));
+	if (name)
+		memcpy(rec->name, name->name, min_t(u32, name->len, ASSOOFS_TRACE_NAME_LEN));
+	trace->seq++;
+	spin_unlock(&trace->lock);
+}
+
+static ssize_t assoofs_trace_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos) {
+	/* El fichero es la secuencia de registros desde el montaje: el registro n esta en n * sizeof(registro) y los que ya se han pisado se saltan */
+	struct assoofs_trace *trace = filp->private_data;
+	const size_t rec_size = sizeof(struct assoofs_trace_record);
+	struct assoofs_trace_record *out;
+	uint64_t first, last, i, n;
+	ssize_t ret;
+
+	n = min_t(size_t, len / rec_size, 64); // Por tandas, para no reservar mucho ni retener el spinlock
+	if (n == 0)
+		return -EINVAL; // Solo se leen registros enteros
+	out = kmalloc_array(n, rec_size, GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	spin_lock(&trace->lock);
+	first = div_u64(*ppos, rec_size);
+	if (trace->seq > ASSOOFS_TRACE_RECORDS && first < trace->seq - ASSOOFS_TRACE_RECORDS)
+		first = trace->seq - ASSOOFS_TRACE_RECORDS;
+	last = first < trace->seq ? min(trace->seq, first + n) : first;
+	for (i = first; i < last; i++)
+		out[i - first] = trace->ring[i % ASSOOFS_TRACE_RECORDS];
+	spin_unlock(&trace->lock);
+
+	ret = (last - first) * rec_size;
+	if (ret && copy_to_user(buf, out, ret))
+		ret = -EFAULT;
+	else
+		*ppos = last * rec_size;
+	kfree(out);
+	return ret;
+}
+
+static const struct file_operations assoofs_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = assoofs_trace_read,
+    .llseek = default_llseek,
+};
+
+static int assoofs_trace_start(struct super_block *sb) {
+	struct assoofs_trace *trace;
+
+	trace = kzalloc(sizeof(*trace), GFP_KERNEL);
+	if (!trace)
+		return -ENOMEM;
+	trace->ring = vzalloc(array_size(ASSOOFS_TRACE_RECORDS, sizeof(struct assoofs_trace_record)));
+	if (!trace->ring) {
+		kfree(trace);
+		return -ENOMEM;
+	}
+	spin_lock_init(&trace->lock);
+	trace->start = ktime_get_ns();
+	trace->dir = debugfs_create_dir(sb->s_id, assoofs_debugfs_root);
+	debugfs_create_file("trace", 0400, trace->dir, trace, &assoofs_trace_fops);
+	ASSOOFS_SB(sb)->trace = trace;
+
+	printk(KERN_INFO "assoofs tracing %s.\n", sb->s_id);
+	return 0;
+}
+
+static void assoofs_trace_stop(struct super_block *sb) {
+	struct assoofs_trace *trace = ASSOOFS_SB(sb)->trace;
+
+	if (!trace)
+		return;
+	debugfs_remove_recursive(trace->dir); // Espera a que terminen las lecturas en curso
+	vfree(trace->ring);
+	kfree(trace);
+	ASSOOFS_SB(sb)->trace = NULL;
+}
 
 /*
  *  Operaciones sobre ficheros
  */
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+static loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence);
+static long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int assoofs_release(struct inode *inode, struct file *filp);
 
 const struct file_operations assoofs_file_operations = {
+    .llseek = assoofs_llseek,
     .read = assoofs_read,
     .write = assoofs_write,
+    .fallocate = assoofs_fallocate,
+    .unlocked_ioctl = assoofs_ioctl,
+    .release = assoofs_release,
 };
 
+/* Bloques que se reservan de una vez para un fichero que escribe, asi dos ficheros que crecen a la vez no se intercalan */
+#define ASSOOFS_PREALLOC_BLOCKS 16
+
+/*
+ *  Reserva de bloques por fichero
+ *  Al reservar un bloque de datos se apartan en memoria los libres que le siguen y el fichero va gastandolos en sus siguientes
+ *  escrituras; los demas no los cogen. Solo se quitan del mapa de bits al usarlos, asi en disco nunca hay bloques ocupados
+ *  que ningun mapa apunte (fsck.assoofs -s sobre un volumen montado no ve nada raro) y si se cae el sistema no hay que
+ *  devolver nada. Lo que sobra se olvida al cerrar el ultimo escritor o al soltar el inodo.
+ */
+static int assoofs_alloc_file_block(struct inode *inode, uint64_t file_block, const uint64_t *map, uint64_t *block) {
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct assoofs_inode *ai = ASSOOFS_I(inode_info);
+	uint64_t goal, run, i;
+	int ret;
+
+	/* 1.- Si queda algo de la tira reservada se usa el siguiente */
+	ret = assoofs_sb_take_reserved_block(sb, ai, block);
+	if (ret != -ENOENT) {
+		if (!ret)
+			assoofs_zero_block(sb, *block, 0);
+		return ret;
+	}
+
+	/* 2.- Si no, se busca detras del ultimo bloque del fichero antes de file_block, o detras del mapa si no tiene ninguno */
+	goal = inode_info->data_block_number + 1 + file_block;
+	for (i = file_block; i > 0; i--) {
+		if (map[i - 1] != ASSOOFS_UNALLOCATED_BLOCK) {
+			goal = map[i - 1] + file_block - (i - 1);
+			break;
+		}
+	}
+
+	/* La tira es mas corta en volumenes pequeños, para no dejar a los demas ficheros sin sitio, y no pasa del final del mapa */
+	run = clamp_t(uint64_t, ASSOOFS_SB(sb)->blocks_count >> 6, 1, ASSOOFS_PREALLOC_BLOCKS);
+	run = min_t(uint64_t, run, ASSOOFS_SB(sb)->blocks_per_file - file_block);
+	ret = assoofs_sb_get_free_blocks(sb, goal, run, block, ai);
+	if (ret)
+		return ret;
+	assoofs_zero_block(sb, *block, 0);
+	return 0;
+}
+
+/* Olvida lo que quede de la tira reservada del fichero, esos bloques nunca salieron del mapa de bits */
+static void assoofs_discard_prealloc(struct inode *inode) {
+	struct assoofs_inode *ai = ASSOOFS_I(inode->i_private);
+
+	mutex_lock(&assoofs_sb_lock);
+	if (ai->prealloc_start < ai->prealloc_end)
+		list_del(&ai->prealloc_list);
+	ai->prealloc_start = ai->prealloc_end = 0;
+	mutex_unlock(&assoofs_sb_lock);
+}
+
+static int assoofs_release(struct inode *inode, struct file *filp) {
+	/* Como ext4, la tira se devuelve cuando cierra el ultimo que tenia el fichero abierto para escribir */
+	if ((filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1) {
+		inode_lock(inode);
+		assoofs_discard_prealloc(inode);
+		inode_unlock(inode);
+	}
+	return 0;
+}
+
+/*
+ *  Mapa de bloques de los ficheros
+ *  Desde ASSOOFS_BLOCKMAP_VERSION el data_block_number de un fichero es un bloque de mapa con un uint64_t por bloque
+ *  logico del fichero (ASSOOFS_UNALLOCATED_BLOCK = hueco). En imagenes anteriores es el unico bloque de datos.
+ */
+static int assoofs_map_block(struct inode *inode, uint64_t file_block, uint64_t goal, int create, uint64_t *block) {
+	/* 
+	* Traduce el bloque logico file_block a bloque de disco en *block (ASSOOFS_UNALLOCATED_BLOCK si es un hueco).
+	* Con create se reserva lo que falte, goal es donde empezar a buscar el mapa (el bloque del directorio padre).
+	*/
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	uint64_t *map, new_block;
+	int ret = 0;
+
+	*block = ASSOOFS_UNALLOCATED_BLOCK;
+	if (file_block >= ASSOOFS_SB(sb)->blocks_per_file)
+		return -EFBIG;
+
+	if (inode_info->data_block_number == ASSOOFS_UNALLOCATED_BLOCK) {
+		if (!create)
+			return 0; // Fichero entero hueco, no hace falta leer nada
+		ret = assoofs_alloc_data_block(sb, inode_info, goal);
+		if (ret)
+			return ret;
+	}
+
+	if (!ASSOOFS_SB(sb)->blockmap) {
+		*block = inode_info->data_block_number;
+		return 0;
+	}
+
+	bh = assoofs_bread_meta(sb, inode_info->data_block_number);
+	if (!bh)
+		return -EIO;
+	map = (uint64_t *)bh->b_data;
+	if (map[file_block] == ASSOOFS_UNALLOCATED_BLOCK && create) {
+		/* Se saca de la tira reservada del fichero, asi una escritura secuencial queda contigua */
+		ret = assoofs_alloc_file_block(inode, file_block, map, &new_block);
+		if (!ret) {
+			lock_buffer(bh);
+			map[file_block] = new_block;
+			assoofs_meta_unlock_dirty(sb, bh); // Se lleva a disco una vez por llamada en assoofs_sync_allocation
+		}
+	}
+	*block = map[file_block];
+	brelse(bh);
+	return ret;
+}
+
+/* Lleva a disco el superbloque y los bloques del mapa de bits que hayan cambiado desde la ultima vez */
+static int assoofs_sync_free_space(struct super_block *sb) {
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t first, last;
+	int ret = 0, err;
+
+	mutex_lock(&assoofs_sb_lock);
+	first = sbi->bitmap_dirty_first;
+	last = sbi->bitmap_dirty_last;
+	sbi->bitmap_dirty_first = sbi->bitmap_dirty_last = 0;
+	mutex_unlock(&assoofs_sb_lock);
+
+	for (; first < last; first++) {
+		bh = assoofs_getblk(sb, sbi->disk->bitmap_block + first); // Si se ha tocado sigue en memoria
+		if (!bh)
+			continue;
+		if (buffer_dirty(bh)) {
+			err = sync_dirty_buffer(bh);
+			if (!ret)
+				ret = err;
+		}
+		brelse(bh);
+	}
+	if (buffer_dirty(sbi->sbh)) {
+		err = sync_dirty_buffer(sbi->sbh);
+		if (!ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/* Lleva a disco el mapa del fichero y el mapa de bits si han cambiado: assoofs_map_block solo los marca, se escriben una vez por write */
+static int assoofs_sync_allocation(struct inode *inode) {
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	int ret = 0, err;
+
+	if (ASSOOFS_SB(sb)->blockmap && inode_info->data_block_number != ASSOOFS_UNALLOCATED_BLOCK) {
+		bh = assoofs_getblk(sb, inode_info->data_block_number); // Si se ha tocado sigue en memoria
+		if (bh) {
+			if (buffer_dirty(bh))
+				ret = sync_dirty_buffer(bh);
+			brelse(bh);
+		}
+	}
+	err = assoofs_sync_free_space(sb);
+	if (!ret)
+		ret = err;
+	return ret;
+}
+
+/* Devuelve el bloque de datos de file_block al mapa de bits y deja un hueco en su lugar */
+static void assoofs_unmap_block(struct inode *inode, uint64_t file_block) {
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	uint64_t *map, block;
+
+	if (inode_info->data_block_number == ASSOOFS_UNALLOCATED_BLOCK)
+		return;
+
+	if (!ASSOOFS_SB(sb)->blockmap) {
+		assoofs_sb_free_block(sb, inode_info->data_block_number);
+		inode_info->data_block_number = ASSOOFS_UNALLOCATED_BLOCK; // Lo guarda quien llama
+		return;
+	}
+
+	bh = assoofs_bread_meta(sb, inode_info->data_block_number);
+	if (!bh)
+		return;
+	map = (uint64_t *)bh->b_data;
+	block = map[file_block];
+	if (block != ASSOOFS_UNALLOCATED_BLOCK) {
+		/* Primero el hueco y despues el mapa de bits: no se bloquean los dos buffers a la vez */
+		lock_buffer(bh);
+		map[file_block] = ASSOOFS_UNALLOCATED_BLOCK;
+		assoofs_meta_unlock_dirty(sb, bh);
+		assoofs_sb_free_block(sb, block);
+	}
+	brelse(bh);
+}
+
+/* Pone a cero los bytes [start, end): los bloques que quedan cubiertos enteros se devuelven y los trozos se borran en su bloque */
+static int assoofs_zero_range(struct inode *inode, loff_t start, loff_t end) {
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	struct buffer_head *bh;
+	uint64_t file_block, block;
+	loff_t block_start, from, to;
+	int ret;
+
+	end = min_t(loff_t, end, sb->s_maxbytes);
+	while (start < end && inode_info->data_block_number != ASSOOFS_UNALLOCATED_BLOCK) {
+		file_block = start >> sb->s_blocksize_bits;
+		block_start = (loff_t)file_block << sb->s_blocksize_bits;
+		from = start - block_start;
+		to = min_t(loff_t, end - block_start, sb->s_blocksize);
+
+		if (from == 0 && to == sb->s_blocksize) {
+			assoofs_unmap_block(inode, file_block);
+		} else {
+			ret = assoofs_map_block(inode, file_block, 0, 0, &block);
+			if (ret)
+				return ret;
+			if (block != ASSOOFS_UNALLOCATED_BLOCK) {
+				bh = assoofs_bread(sb, block); // Bloque de datos, sin suma
+				if (!bh)
+					return -EIO;
+				memset(bh->b_data + from, 0, to - from);
+				mark_buffer_dirty(bh);
+				brelse(bh);
+			}
+		}
+		start = block_start + to;
+	}
+	return 0;
+}
+
+/* Recorta el fichero a size devolviendo los bloques que quedan fuera; si se queda vacio tambien se devuelve el mapa */
+static int assoofs_truncate_blocks(struct inode *inode, loff_t size) {
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	int ret;
+
+	ret = assoofs_zero_range(inode, size, sb->s_maxbytes);
+	if (ret)
+		return ret;
+
+	if (size == 0 && ASSOOFS_SB(sb)->blockmap && inode_info->data_block_number != ASSOOFS_UNALLOCATED_BLOCK) {
+		assoofs_sb_free_block(sb, inode_info->data_block_number);
+		inode_info->data_block_number = ASSOOFS_UNALLOCATED_BLOCK;
+	}
+	return 0;
+}
+
+/* Bloque del directorio padre, es el objetivo para que los bloques de un directorio queden juntos */
+static uint64_t assoofs_parent_goal(struct file *filp) {
+	struct dentry *parent = dget_parent(filp->f_path.dentry);
+	uint64_t goal = ((struct assoofs_inode_info *)parent->d_inode->i_private)->data_block_number;
+
+	dput(parent);
+	return goal;
+}
+
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
 	/* 
 	* Parametros
@@ -51,37 +572,77 @@ ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t *
 
 	/* Variables necesarias */
 	/* Paso 1 */
+	struct inode *inode;
+	struct super_block *sb;
 	struct assoofs_inode_info *inode_info;
 	/* Paso 3 */
-	struct buffer_head *bh; // Un buffer head para leer un bloque
-	char *buffer;
+	struct buffer_head *bhs[ASSOOFS_IO_BATCH]; // Bloques de la tanda en orden, NULL en los huecos
+	struct buffer_head *pending[ASSOOFS_IO_BATCH]; // Los que hay que pedir al disco
+	uint64_t block;
+	loff_t pos;
+	int i, n, nr, err = 0, ret = 0;
 	/* Paso 4 */
-	int nbytes;
+	size_t nbytes, done, offset, chunk;
 
 	printk(KERN_INFO "assoofs read request.");
 	/* 1.- Obtener la informacion persistente del inodo */
-	inode_info = filp->f_path.dentry->d_inode->i_private;
+	inode = filp->f_path.dentry->d_inode;
+	sb = inode->i_sb;
+	inode_info = inode->i_private;
+	assoofs_trace(sb, ASSOOFS_TRACE_READ, inode_info->inode_no, 0, *ppos, len, NULL);
 
-	/* 2.- Comprobar el valor de ppos para ver si es mayor que el tam del fichero */
-	if(*ppos >= inode_info->file_size) return 0;
+	/* Como en assoofs_llseek: perforar y truncar devuelven bloques con inode_lock, no se pueden soltar entre mapearlos y copiarlos */
+	inode_lock_shared(inode);
 
-	/* 3.- Acceder al contenido del fichero */
-	mutex_lock_interruptible(&assoofs_sb_lock);
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number); // Se lee ese inodo del superbloque
-	mutex_unlock(&assoofs_sb_lock);
-	buffer = (char *)bh->b_data;
-
-	/* 4.- Copiamos a buf el contenido del fichero */
-	nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tam del fichero por si llegamos al final del fichero
-	copy_to_user(buf, buffer, nbytes); //Funcion auxiliar que copia nbytes de buffer en buf
+	/* 2.- Comprobar el valor de ppos para ver si es mayor que el tam del fichero */
+	if(*ppos >= inode_info->file_size){
+		inode_unlock_shared(inode);
+		return 0;
+	}
+	nbytes = min((size_t) (inode_info->file_size - *ppos), len); // Hay que comparar len con lo que queda de fichero por si llegamos al final
+
+	for(done = 0; done < nbytes && !ret; ){
+		/* 3.- Se mapea una tanda de bloques y se piden todos a la vez, con striping cada uno va a su dispositivo */
+		nr = 0;
+		for(n = 0, pos = *ppos + done; n < ASSOOFS_IO_BATCH && pos < *ppos + nbytes; n++, pos = round_down(pos, sb->s_blocksize) + sb->s_blocksize){
+			err = assoofs_map_block(inode, pos >> sb->s_blocksize_bits, 0, 0, &block);
+			if(err) break;
+			bhs[n] = NULL; // Los huecos se leen como ceros sin acceder a disco
+			if(block == ASSOOFS_UNALLOCATED_BLOCK) continue;
+			bhs[n] = assoofs_getblk(sb, block);
+			if(!bhs[n]){
+				err = -ENOMEM;
+				break;
+			}
+			pending[nr++] = bhs[n];
+		}
+		ll_rw_block(REQ_OP_READ, 0, nr, pending); // No espera, los que ya estaban en memoria se saltan
+
+		/* 4.- Copiamos a buf el contenido de los bloques en orden segun van llegando */
+		for(i = 0; i < n; i++){
+			offset = (*ppos + done) & (sb->s_blocksize - 1);
+			chunk = min(nbytes - done, (size_t) sb->s_blocksize - offset);
+			if(!ret && !bhs[i] && clear_user(buf + done, chunk))
+				ret = -EFAULT;
+			if(!ret && bhs[i]){
+				wait_on_buffer(bhs[i]);
+				if(!buffer_uptodate(bhs[i])) ret = -EIO;
+				else if(copy_to_user(buf + done, bhs[i]->b_data + offset, chunk)) ret = -EFAULT; //Funcion auxiliar que copia chunk bytes del bloque en buf
+			}
+			if(!ret) done += chunk;
+			brelse(bhs[i]);
+		}
+		if(!ret) ret = err;
+	}
+	inode_unlock_shared(inode);
+	if(done == 0 && ret) return ret;
 
 	/* 5.- Incrementar la posicion donde se comienza a leer */
-	*ppos += nbytes;
-	brelse(bh);
+	*ppos += done;
 
 	/* 6.- Devolver los bytes leidos */
-	printk(KERN_INFO "assoofs read complete (%d bytes).\n", nbytes);
-	return nbytes;
+	printk(KERN_INFO "assoofs read complete (%zu bytes).\n", done);
+	return done;
 }
 
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
@@ -95,42 +656,180 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
 
 	/* Variables necesarias */
 	/* Paso 1 */
+	struct inode *inode;
 	struct assoofs_inode_info *inode_info;
 	/* Paso 3 */
-	struct buffer_head *bh; // Un buffer head para leer un bloque
-	char *buffer;
+	struct buffer_head *bhs[ASSOOFS_IO_BATCH]; // Bloques de la tanda en orden
+	struct buffer_head *pending[ASSOOFS_IO_BATCH]; // Los que no se sobreescriben enteros y hay que leer antes
+	uint64_t block, goal;
+	size_t offset, chunk, done;
+	loff_t pos;
+	int i, n, nr, err = 0;
 	/* Paso 5 */
 	struct super_block *sb;
+	int ret = 0;
 
 	printk(KERN_INFO "assoofs write request of length %ld.\n", len);
 	/* 1.- Obtener la informacion persistente del inodo */
-	inode_info = filp->f_path.dentry->d_inode->i_private;
+	inode = filp->f_path.dentry->d_inode;
+	inode_info = inode->i_private;
+	sb = inode->i_sb;
+
+	inode_lock(inode);
+	if(filp->f_flags & O_APPEND) *ppos = inode_info->file_size;
+	assoofs_trace(sb, ASSOOFS_TRACE_WRITE, inode_info->inode_no, 0, *ppos, len, NULL);
+
+	/* 2.- El fichero no puede pasar de lo que cabe en su mapa */
+	if(*ppos >= sb->s_maxbytes){
+		inode_unlock(inode);
+		return -EFBIG;
+	}
+	len = min(len, (size_t) (sb->s_maxbytes - *ppos));
+
+	/* 3.- Copiamos de buf por tandas de bloques. Los bloques se reservan al escribirlos, los que no se tocan siguen siendo huecos */
+	goal = assoofs_parent_goal(filp);
+	for(done = 0; done < len && !ret; ){
+		nr = 0;
+		for(n = 0, pos = *ppos + done; n < ASSOOFS_IO_BATCH && pos < *ppos + len; n++, pos = round_down(pos, sb->s_blocksize) + sb->s_blocksize){
+			err = assoofs_map_block(inode, pos >> sb->s_blocksize_bits, goal, 1, &block);
+			if(!err && !(bhs[n] = assoofs_getblk(sb, block)))
+				err = -ENOMEM;
+			if(err) break;
+			if((pos & (sb->s_blocksize - 1)) || *ppos + len - pos < sb->s_blocksize)
+				pending[nr++] = bhs[n]; // Se escribe solo una parte, el resto tiene que venir del disco
+		}
+		ll_rw_block(REQ_OP_READ, 0, nr, pending);
+
+		for(i = 0; i < n; i++){
+			offset = (*ppos + done) & (sb->s_blocksize - 1);
+			chunk = min(len - done, (size_t) sb->s_blocksize - offset);
+			wait_on_buffer(bhs[i]);
+			if(!ret && chunk < sb->s_blocksize && !buffer_uptodate(bhs[i])) ret = -EIO;
+			if(!ret && copy_from_user(bhs[i]->b_data + offset, buf + done, chunk)) ret = -EFAULT;
+			if(ret) continue;
+			set_buffer_uptodate(bhs[i]);
+			mark_buffer_dirty(bhs[i]); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
+			write_dirty_buffer(bhs[i], REQ_SYNC); // Se envia sin esperar, asi las escrituras de la tanda van a la vez
+			done += chunk;
+		}
+		/* 4.- Se espera a que toda la tanda este en disco */
+		for(i = 0; i < n; i++){
+			wait_on_buffer(bhs[i]);
+			if(!ret && buffer_write_io_error(bhs[i])) ret = -EIO;
+			brelse(bhs[i]);
+		}
+		if(!ret) ret = err;
+	}
 
-	/* 2.- Acceder al contenido del fichero */
-	mutex_lock_interruptible(&assoofs_sb_lock);
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number); // Se lee ese inodo del superbloque
-	buffer = (char *)bh->b_data;
+	/* Los bloques nuevos de la llamada quedan en el mapa y en el mapa de bits, se escriben los dos una sola vez */
+	err = assoofs_sync_allocation(inode);
+	if(!ret) ret = err;
 
-	/* 3.- Copiamos a buf el contenido del fichero */
-	buffer += *ppos;
-	copy_from_user(buffer, buf, len);
+	/* Incrementar la posicion donde se comienza a escribir */
+	*ppos += done;
 
-	/* 4.- Incrementar la posicion donde se comienza a leer */
-	*ppos += len;
+	/* 5.- El tam solo crece, truncar es cosa de assoofs_setattr */
+	if(*ppos > inode_info->file_size){
+		inode_info->file_size = *ppos;
+		i_size_write(inode, inode_info->file_size); // El inodo sigue en cache, su tam tiene que coincidir con el del disco
+	}
+	assoofs_save_inode_info(sb, inode_info);
+	inode_unlock(inode);
 
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
-	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
-	mutex_unlock(&assoofs_sb_lock);	
+	printk(KERN_INFO "assoofs write complete (%zu bytes).\n", done);
+	return done ? done : ret;
+}
 
-	brelse(bh);
+static long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len) {
+	/* 
+	* Parametros
+	* 1.- Fichero
+	* 2.- Modo: 0 reserva y amplia el tam, FALLOC_FL_KEEP_SIZE solo reserva, FALLOC_FL_PUNCH_HOLE perfora
+	* 3.- Desplazamiento y 4.- longitud del rango
+	*/
 
-	/* 5.- Devolver los bytes leidos */
-	inode_info->file_size = *ppos;
-	sb = filp->f_path.dentry->d_inode->i_sb;
-	assoofs_save_inode_info(sb, inode_info);
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	uint64_t file_block, block, goal;
+	loff_t end = offset + len;
+	int ret = 0, err;
+
+	printk(KERN_INFO "assoofs fallocate request (mode %d, %lld+%lld).\n", mode, offset, len);
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	if(mode & FALLOC_FL_PUNCH_HOLE){ // El VFS ya exige que venga con FALLOC_FL_KEEP_SIZE
+		/* Los bloques cubiertos enteros se devuelven y se leen como ceros, los bordes se ponen a cero */
+		ret = assoofs_zero_range(inode, offset, end);
+		goto save;
+	}
 
-	printk(KERN_INFO "assoofs read complete (%ld bytes).\n", len);
-	return len;
+	/* Reserva de los bloques por adelantado */
+	if(end > sb->s_maxbytes){
+		ret = -EFBIG;
+		goto out;
+	}
+	goal = assoofs_parent_goal(filp);
+	for(file_block = offset >> sb->s_blocksize_bits; ((loff_t)file_block << sb->s_blocksize_bits) < end; file_block++){
+		ret = assoofs_map_block(inode, file_block, goal, 1, &block);
+		if(ret)
+			break;
+	}
+	err = assoofs_sync_allocation(inode);
+	if(!ret)
+		ret = err;
+	if(!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > inode_info->file_size){
+		inode_info->file_size = end;
+		i_size_write(inode, end);
+	}
+
+save:
+	err = assoofs_save_inode_info(sb, inode_info);
+	if(!ret)
+		ret = err;
+out:
+	inode_unlock(inode);
+	return ret;
+}
+
+static loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence) {
+	/* SEEK_DATA y SEEK_HOLE miran el mapa de bloques; el resto de casos son los de siempre */
+	struct inode *inode = file_inode(filp);
+	struct super_block *sb = inode->i_sb;
+	uint64_t file_block, block;
+	loff_t size, pos;
+	int ret;
+
+	if(whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(filp, offset, whence);
+
+	inode_lock_shared(inode);
+	size = i_size_read(inode);
+	if(offset < 0 || offset >= size){
+		inode_unlock_shared(inode);
+		return -ENXIO;
+	}
+
+	/* Primer bloque con datos (SEEK_DATA) o primer hueco (SEEK_HOLE) desde offset. El final del fichero cuenta como hueco */
+	pos = size;
+	for(file_block = offset >> sb->s_blocksize_bits; ((loff_t)file_block << sb->s_blocksize_bits) < size; file_block++){
+		ret = assoofs_map_block(inode, file_block, 0, 0, &block);
+		if(ret){
+			inode_unlock_shared(inode);
+			return ret;
+		}
+		if((block != ASSOOFS_UNALLOCATED_BLOCK) == (whence == SEEK_DATA)){
+			pos = max_t(loff_t, offset, (loff_t)file_block << sb->s_blocksize_bits);
+			break;
+		}
+	}
+	inode_unlock_shared(inode);
+
+	if(whence == SEEK_DATA && pos == size)
+		return -ENXIO; // No hay mas datos
+	return vfs_setpos(filp, pos, sb->s_maxbytes);
 }
 
 /*
@@ -141,6 +840,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .unlocked_ioctl = assoofs_ioctl,
 };
 
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
@@ -163,6 +863,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 	/* 1.- Acceder al inodo del argumento filp */
 	inode = filp->f_path.dentry->d_inode; // Se obtiene el inodo del file
 	inode_info = inode->i_private; // Parte persistente del inodo
+	assoofs_trace(inode->i_sb, ASSOOFS_TRACE_ITERATE, inode_info->inode_no, 0, ctx->pos, 0, NULL);
 
 	/* 2.- Comprobar si el contexto del directorio ya esta creado */
 	if(ctx->pos) return 0; // Si el campo pos del contexto es distinto de cero se acaba
@@ -173,8 +874,10 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 	/* 4.- Leer el bloque del contenido del directorio e inicializar ctx */
 	mutex_lock_interruptible(&assoofs_sb_lock);
 	sb = inode->i_sb; // Se obtiene el superbloque
-	bh = sb_bread(sb, inode_info->data_block_number);
+	bh = assoofs_bread_meta(sb, inode_info->data_block_number);
 	mutex_unlock(&assoofs_sb_lock);
+	if (!bh)
+		return -EIO;
 	record = (struct assoofs_dir_record_entry *)bh->b_data;
 	for (i = 0; i < inode_info->dir_children_count; i++){
 		/* Llamamos a dir-emit para añadir nuevas entradas al contexto */
@@ -194,11 +897,20 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
+static int assoofs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr);
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create,
     .lookup = assoofs_lookup,
     .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .rename = assoofs_rename,
+    .setattr = assoofs_setattr,
+    /* Sin .permission: generic_permission solo lee i_mode, i_uid e i_gid y no bloquea, vale en modo RCU */
 };
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
 
@@ -219,11 +931,16 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
     struct inode *inode;
     int i;
 
+    /* Los nombres se guardan con su '\0' en ASSOOFS_FILENAME_MAXLEN bytes */
+    if (child_dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
+
     /* 1.- Acceder al bloque de disco con el contenido del directorio apuntado por parent_inode */
-    mutex_lock_interruptible(&assoofs_sb_lock);
+    // Sin mutex global: el VFS ya tiene bloqueado parent_inode y assoofs_bread no necesita mas, asi varios hilos buscan en paralelo
     sb = parent_inode->i_sb; // Se saca el superbloque
-    bh = sb_bread(sb, parent_info->data_block_number); // Se lee el bloque que contiene la informacion del directorio parent
-    mutex_unlock(&assoofs_sb_lock);
+    bh = assoofs_bread_meta(sb, parent_info->data_block_number); // Se lee el bloque que contiene la informacion del directorio parent
+    if (!bh)
+        return ERR_PTR(-EIO);
     printk(KERN_INFO "Lookup request in inode %llu in the block %llu.\n", parent_info->inode_no, parent_info->data_block_number);
 
 
@@ -233,16 +950,22 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
         if (!strcmp(record->filename, child_dentry->d_name.name)) { // Se compara el fichero del puntero actual con el argumento
             // Si son iguales ( el strcmp devuelve 0 si son iguales, por eso el !)
             printk(KERN_INFO "File %s found in inode %llu at pos %d of the dir inode %llu.\n", record->filename, record->inode_no ,i, parent_info->inode_no);
-            inode = assoofs_get_inode(sb, record->inode_no); // Guardar la informacion del inodo en cuestion
-            inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode); // Le damos padre y modo del inode
+            assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, record->inode_no, parent_info->inode_no, 0, 0, &child_dentry->d_name);
+            inode = assoofs_get_inode(sb, record->inode_no); // Guardar la informacion del inodo en cuestion (modo y propietario salen del disco)
+            brelse(bh);
+            if (IS_ERR(inode))
+                return ERR_CAST(inode);
             d_add(child_dentry, inode); // Se llama a la funcion que construye el arbol de inodos para que meta este
             return NULL;
         }
         record++;
     }
+    brelse(bh);
 
     /* Si se sale del bucle es que no se encontro el inodo */
-    printk(KERN_ERR "Inode with filename %s not found.\n", child_dentry->d_name.name); //Control de errores
+    printk(KERN_INFO "Inode with filename %s not found.\n", child_dentry->d_name.name);
+    assoofs_trace(sb, ASSOOFS_TRACE_LOOKUP, 0, parent_info->inode_no, 0, 0, &child_dentry->d_name);
+    d_add(child_dentry, NULL); // Dentry negativa: las siguientes busquedas de este nombre se resuelven en el dcache sin llamar a lookup
     return NULL;
 }
 
@@ -252,30 +975,52 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
     struct inode *inode;
     struct assoofs_inode_info *inode_info;
 
+    /* 0.- Si el inodo sigue en la cache de inodos se reutiliza: un inodo estable por numero es lo que deja al dcache resolver rutas en modo RCU */
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
     printk(KERN_INFO "assoofs_get_inode request at inode %d.\n", ino);
     /* 1.- Obtener la informacion persistente del inodo */
     inode_info = assoofs_get_inode_info(sb, ino); 
+    if (!inode_info) {
+        printk(KERN_ERR "Inode %d is not in the inode store.\n", ino); //Control de errores
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
 
-    /* 2.- Crear y asignar el campos al inodo */
-    inode = new_inode(sb); // Se crea
-    inode->i_ino = ino; // Se le asigna el numero al parametro
-    inode->i_sb = sb; // Se le asigna el superbloque de los parametros de funcion
+    /* 2.- Asignar los campos al inodo (iget_locked ya puso i_ino e i_sb) */
     inode->i_op = &assoofs_inode_ops; // Se le dan las operaciones al inodo (create, lookup y mkdir)
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); //Asignamos el tiempo actual al tiempo de creacion acceso y modificacion
     inode->i_private = inode_info; // Se guarda en el private la informacion persistente obtenida
+    inode->i_mode = inode_info->mode;
+    if (ASSOOFS_SB(sb)->disk->version >= ASSOOFS_OWNERSHIP_VERSION) { // En imagenes antiguas el propietario es root
+        i_uid_write(inode, inode_info->uid);
+        i_gid_write(inode, inode_info->gid);
+    }
     // Segun si es directorio o archivo se le dan las operaciones especiales
-    if (S_ISDIR(inode_info->mode))
+    if (S_ISDIR(inode_info->mode)) {
         inode->i_fop = &assoofs_dir_operations;
-    else if (S_ISREG(inode_info->mode))
+    } else if (S_ISREG(inode_info->mode)) {
         inode->i_fop = &assoofs_file_operations;
-    else
+        inode->i_size = inode_info->file_size;
+    } else {
         printk(KERN_ERR "Unknown inode type.\n"); //Control de errores
+    }
 
+    unlock_new_inode(inode);
     printk(KERN_INFO "assoofs_get_inode successfully found the inode.\n");
     return inode;
 }
 
 
+/* El almacen guarda uid y gid en 16 bits: un id mas grande (o sin correspondencia, -1) se perderia al recortarlo */
+static bool assoofs_ids_fit(uid_t uid, gid_t gid) {
+	return uid <= U16_MAX && gid <= U16_MAX;
+}
+
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
 	/* 
 	* Parametros
@@ -290,127 +1035,356 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 	struct inode *inode;
 	struct assoofs_inode_info *inode_info;
 	struct super_block *sb;
-	uint64_t count;
-	/* Paso 2 */
 	struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	struct buffer_head *bh; // Un buffer head para leer un bloque
-	/* Paso 3 */
+	int ret;
 
 
 	printk("assoofs create request for %s.\n", dentry->d_name.name);
 	/* 1.- Crear el nuevo inodo */
-	mutex_lock_interruptible(&assoofs_sb_lock);
+	parent_inode_info = dir->i_private; // Informacion persistente del inodo padre
+	if(parent_inode_info->dir_children_count >= ASSOOFS_SB(dir->i_sb)->dir_records_per_block){
+		printk(KERN_ERR "assoofs directory %lu is full.\n", dir->i_ino); //Control de errores
+		return -ENOSPC;
+	}
 	sb = dir->i_sb; //Obtengo el superbloque del directorio padre
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // Obtengo el num inodos de la info persistente del sb
 	inode = new_inode(sb); // Se crea el inodo
-	mutex_unlock(&assoofs_sb_lock);
-	if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED /* (64) */){
-		printk(KERN_ERR "assoofs can not hold more files. (%lld of %d).\n", count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); //Control de errores
-		return -EPERM;
-	}
-	inode->i_ino = count + 1; // Se le asigna el siguiente numero
+	if(!inode)
+		return -ENOMEM;
 	inode->i_sb = sb; // asignar superbloque al inodo
     inode->i_op = &assoofs_inode_ops; // asignar operaciones al inodo
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // asignar fechas al inodo
 	inode->i_fop=&assoofs_file_operations; //Es un fichero nunca un directorio (mkdir)
 	/* Asignar las propiedades del inodo */
-	inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache)
-	inode_info->inode_no = inode->i_ino;
-	inode_info->mode = mode; // El segundo mode me llega como argumento
+	inode_info = kmem_cache_zalloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache), sin tira reservada
+	if(!inode_info){
+		iput(inode);
+		return -ENOMEM;
+	}
 	inode_info->file_size = 0;
-	inode->i_private = inode_info; // No inode info
+	inode_info->data_block_number = ASSOOFS_UNALLOCATED_BLOCK; // El bloque se reserva en la primera escritura (assoofs_write)
 	inode_init_owner(inode, dir, mode);
-	d_add(dentry, inode);
+	inode_info->mode = inode->i_mode; // inode_init_owner puede quitar S_ISGID si el que crea no esta en el grupo
+	if(!assoofs_ids_fit(i_uid_read(inode), i_gid_read(inode))){
+		kmem_cache_free(assoofs_inode_cache, inode_info);
+		iput(inode);
+		return -EOVERFLOW;
+	}
+	inode_info->uid = i_uid_read(inode); // El propietario se guarda en disco
+	inode_info->gid = i_gid_read(inode);
+
+	/* El numero de inodo se elige al meterlo en el almacen, en la misma seccion critica (los de ficheros borrados se reutilizan) */
+	ret = assoofs_add_inode_info(sb, inode_info);
+	if(ret){
+		printk(KERN_ERR "assoofs can not hold more files (max %lld).\n", ASSOOFS_SB(sb)->max_inodes); //Control de errores
+		kmem_cache_free(assoofs_inode_cache, inode_info);
+		iput(inode);
+		return ret;
+	}
+	inode->i_ino = inode_info->inode_no;
+	inode->i_private = inode_info; // No inode info
+	insert_inode_hash(inode); // Para que assoofs_get_inode lo encuentre en la cache de inodos
+
+	/* 2.- Modificar el contenido del directorio padre para meter el inodo y actualizar su informacion persistente */
+	ret = assoofs_add_dir_record(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no);
+	if(ret){
+		/* Sin enlaces, assoofs_evict_inode lo saca del almacen */
+		clear_nlink(inode);
+		iput(inode);
+		return ret;
+	}
+	d_instantiate(dentry, inode); // lookup ya la metio en el dcache como negativa, d_add la encadenaria dos veces
 
-	if(assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number) != 0){ //Funcion auxiliar que busca un bloque libre para el inodo
-		printk(KERN_ERR "assoofs can not hold more files. (%lld of %d).\n", count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); //Control de errores
-		return -EPERM;
-	} 
+	assoofs_trace(sb, ASSOOFS_TRACE_CREATE, inode_info->inode_no, parent_inode_info->inode_no, 0, 0, &dentry->d_name);
+	printk(KERN_INFO "assoofs create successfully file %s.\n", dentry->d_name.name);
+    return 0; // Todo ha ido bien 
+}
 
-	assoofs_add_inode_info(sb, inode_info);
+/* FUNCIONES AUXILIARES DE CREATE */
+/*
+ * Parte del mapa de bits donde esta el bit de block: un bloque del mapa de bits desde ASSOOFS_BITMAP_VERSION, antes el
+ * free_blocks del superbloque. Devuelve los bits, su buffer (se suelta con brelse), el bloque del primer bit y cuantos bits
+ * hay dentro del volumen. Con assoofs_sb_lock.
+ */
+static unsigned long *assoofs_bitmap_bits(struct super_block *sb, uint64_t block, struct buffer_head **bh, uint64_t *first, uint64_t *nbits){
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t chunk;
+
+	if (!sbi->bitmap) {
+		*bh = sbi->sbh;
+		get_bh(*bh);
+		*first = 0;
+		*nbits = min_t(uint64_t, sbi->blocks_count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+		return (unsigned long *)&sbi->disk->free_blocks;
+	}
 
-	/* 2.- Modificar el contenido del directorio padre para meter el inodo */
-	parent_inode_info = dir->i_private; // Informacion persistente del inodo padre
+	chunk = div64_u64(block, sbi->bitmap_bits);
+	*bh = assoofs_bread_meta(sb, sbi->disk->bitmap_block + chunk);
+	if (!*bh) {
+		printk(KERN_ERR "assoofs can not read free space bitmap block %llu.\n", sbi->disk->bitmap_block + chunk);
+		return NULL;
+	}
+	*first = chunk * sbi->bitmap_bits;
+	*nbits = min_t(uint64_t, sbi->bitmap_bits, sbi->blocks_count - *first);
+	return (unsigned long *)(*bh)->b_data;
+}
 
-	mutex_lock_interruptible(&assoofs_sb_lock);
-	bh = sb_bread(sb, parent_inode_info->data_block_number); // Creamos un buffer head para leer el bloque del directorio padre
+/* Suelta el buffer del mapa de bits bloqueado para cambiarlo y apunta que bloque es para assoofs_sync_free_space. Con assoofs_sb_lock */
+static void assoofs_bitmap_unlock_dirty(struct super_block *sb, struct buffer_head *bh, uint64_t first){
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t chunk;
+
+	assoofs_meta_unlock_dirty(sb, bh);
+	if (!sbi->bitmap)
+		return;
+	chunk = div64_u64(first, sbi->bitmap_bits);
+	if (sbi->bitmap_dirty_first >= sbi->bitmap_dirty_last) {
+		sbi->bitmap_dirty_first = chunk;
+		sbi->bitmap_dirty_last = chunk + 1;
+	} else {
+		sbi->bitmap_dirty_first = min(sbi->bitmap_dirty_first, chunk);
+		sbi->bitmap_dirty_last = max(sbi->bitmap_dirty_last, chunk + 1);
+	}
+}
 
-	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data; 
-	dir_contents += parent_inode_info->dir_children_count; // Se avanza los hijos que ya tiene hasta el primer hueco libre
-	dir_contents->inode_no = inode_info->inode_no; // Se actualiza el numero de hijos
-	strcpy(dir_contents->filename, dentry->d_name.name); // Se copia el nombre
+/* Tira reservada de algun fichero en la que cae block, o NULL. Son pocas: una por fichero abierto para escribir. Con assoofs_sb_lock */
+static struct assoofs_inode *assoofs_find_prealloc(struct super_block *sb, uint64_t block){
+	struct assoofs_inode *ai;
 
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
-	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
+	list_for_each_entry(ai, &ASSOOFS_SB(sb)->prealloc, prealloc_list)
+		if (block >= ai->prealloc_start && block < ai->prealloc_end)
+			return ai;
+	return NULL;
+}
+
+/*
+ * Busca el primer bloque libre de [from, to) que no este en la tira de ningun fichero y lo quita del mapa de bits. En *count
+ * dice cuantos libres seguidos hay desde el, hasta max y sin pasar a otro bloque del mapa; los demas se quedan en el mapa
+ */
+static int assoofs_claim_free_blocks(struct super_block *sb, uint64_t from, uint64_t to, uint64_t max, uint64_t *block, uint64_t *count){
+	struct assoofs_inode *ai;
+	struct buffer_head *bh;
+	unsigned long *bits;
+	uint64_t first, nbits, i, n;
+
+	while (from < to) {
+		bits = assoofs_bitmap_bits(sb, from, &bh, &first, &nbits);
+		if (!bits)
+			return -EIO;
+		nbits = min(nbits, to - first);
+		i = find_next_bit_le(bits, nbits, from - first); // El bit b es el b % 8 del byte b / 8, igual en el disco que en memoria
+		while (i < nbits && (ai = assoofs_find_prealloc(sb, first + i)))
+			i = find_next_bit_le(bits, nbits, min(nbits, ai->prealloc_end - first)); // Se salta la tira de otro fichero
+		if (i < nbits) {
+			for (n = 1; n < max && i + n < nbits && test_bit_le(i + n, bits) && !assoofs_find_prealloc(sb, first + i + n); n++)
+				;
+			*block = first + i;
+			*count = n;
+			lock_buffer(bh);
+			__clear_bit_le(i, bits); // Marca que el bloque ahora es 0 (En memoria)
+			assoofs_bitmap_unlock_dirty(sb, bh, first);
+			brelse(bh);
+			return 0;
+		}
+		brelse(bh);
+		from = first + nbits;
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Quita del mapa de bits el primer bloque libre desde goal y lo devuelve en *block. Con reserve, los hasta max-1 libres que le
+ * sigan se apartan en memoria como tira de ese fichero. No se sincroniza: quien reserva lleva el mapa de bits a disco junto con
+ * lo que apunta a los bloques.
+ */
+int assoofs_sb_get_free_blocks(struct super_block *sb, uint64_t goal, uint64_t max, uint64_t *block, struct assoofs_inode *reserve){
+	uint64_t blocks_count, count;
+	int ret;
+
+	mutex_lock(&assoofs_sb_lock);
+	blocks_count = ASSOOFS_SB(sb)->blocks_count;
+	if (goal <= ASSOOFS_INODESTORE_BLOCK_NUMBER || goal >= blocks_count)
+		goal = ASSOOFS_INODESTORE_BLOCK_NUMBER + 1; // Los dos primeros bloques son sb y almacen de inodos
+	/* Se busca a partir de goal (el bloque del directorio padre) y se da la vuelta, asi los bloques de un directorio quedan seguidos */
+	ret = assoofs_claim_free_blocks(sb, goal, blocks_count, max, block, &count);
+	if (ret == -ENOSPC)
+		ret = assoofs_claim_free_blocks(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER + 1, goal, max, block, &count);
+	if (!ret && reserve && count > 1) {
+		reserve->prealloc_start = *block + 1;
+		reserve->prealloc_end = *block + count;
+		list_add(&reserve->prealloc_list, &ASSOOFS_SB(sb)->prealloc);
+	}
 	mutex_unlock(&assoofs_sb_lock);
-	brelse(bh); // Se libera el buffer head
+	return ret; // -ENOSPC si no queda ningun bloque libre
+}
 
-	/* 3.- Actualizar la informacion persistente del inodo padre */
-	parent_inode_info->dir_children_count++;
-	assoofs_save_inode_info(sb, parent_inode_info); // Funcion auxiliar que actualiza la informacion persistente del inodo padre 
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block){
+	return assoofs_sb_get_free_blocks(sb, goal, 1, block, NULL);
+}
 
-	printk(KERN_INFO "assoofs create successfully file %s.\n", dentry->d_name.name);
-    return 0; // Todo ha ido bien 
+/* Quita del mapa de bits el siguiente bloque de la tira reservada del fichero, -ENOENT si no le queda ninguno */
+int assoofs_sb_take_reserved_block(struct super_block *sb, struct assoofs_inode *ai, uint64_t *block){
+	struct buffer_head *bh;
+	unsigned long *bits;
+	uint64_t first, nbits;
+
+	mutex_lock(&assoofs_sb_lock);
+	if (ai->prealloc_start >= ai->prealloc_end) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -ENOENT;
+	}
+	*block = ai->prealloc_start;
+	bits = assoofs_bitmap_bits(sb, *block, &bh, &first, &nbits);
+	if (!bits) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	__clear_bit_le(*block - first, bits); // Nadie mas lo ha podido coger, estaba apartado
+	assoofs_bitmap_unlock_dirty(sb, bh, first);
+	brelse(bh);
+	if (++ai->prealloc_start == ai->prealloc_end)
+		list_del(&ai->prealloc_list);
+	mutex_unlock(&assoofs_sb_lock);
+	return 0;
 }
 
-/* FUNCIONES AUXILIARES DE CREATE */
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
-	struct assoofs_super_block_info *assoofs_sb;
+/* Pide un bloque libre lo mas cerca posible de goal y lo deja a ceros, puede venir de un fichero borrado. Si es de metadatos (meta) se le pone la suma */
+int assoofs_alloc_zeroed_block(struct super_block *sb, uint64_t goal, uint64_t *block, int meta){
+	int ret;
+
+	ret = assoofs_sb_get_a_freeblock(sb, goal, block);
+	if (ret)
+		return ret;
+
+	assoofs_zero_block(sb, *block, meta);
+	return 0;
+}
+
+/* Deja a ceros un bloque recien reservado, sin leerlo de disco */
+void assoofs_zero_block(struct super_block *sb, uint64_t block, int meta){
+	struct buffer_head *bh;
+
+	bh = assoofs_getblk(sb, block); // No hace falta leerlo de disco, se sobreescribe entero
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	if (meta) {
+		set_buffer_verified(bh); // Lo que hay en memoria es lo que se acaba de sumar
+		assoofs_meta_unlock_dirty(sb, bh);
+	} else {
+		clear_buffer_verified(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+	}
+	brelse(bh);
+}
+
+/* Reserva el bloque de data_block_number del inodo (datos, o el mapa si el fichero tiene mapa de bloques) */
+int assoofs_alloc_data_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t goal){
+	uint64_t block;
+	int ret;
+
+	ret = assoofs_alloc_zeroed_block(sb, goal, &block, ASSOOFS_SB(sb)->blockmap);
+	if (ret)
+		return ret;
+
+	inode_info->data_block_number = block;
+	return assoofs_save_inode_info(sb, inode_info);
+}
+
+/* Busca el primer numero de inodo que no este en el almacen store (los de objetos borrados se reutilizan). Con assoofs_inodestore_lock */
+int assoofs_sb_get_a_freeinode(struct super_block *sb, struct assoofs_inode_info *store, uint64_t *inode_no){
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->disk;
+	uint64_t used = 0; // Mapa de bits de numeros de inodo en uso (bit inode_no - 1)
 	int i;
 
-	assoofs_sb = sb->s_fs_info; // Obtenemos la informacion persistente del superbloque
-	
-	for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) // Se empieza por 2 porque los dos primeros bloques son sb y almacen de inodos
-		if (assoofs_sb->free_blocks & (1 << i)) //Comprueba si el bit del indice vale 1
-			break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits
+	for (i = 0; i < assoofs_sb->inodes_count; i++, store++)
+		used |= 1ULL << (store->inode_no - 1);
 
-	*block = i; // Escribimos el valor de i en la direccion de memoria que vamos a devolver
+	if (~used == 0)
+		return -ENOSPC; // Los 64 numeros estan ocupados
 
-	assoofs_sb->free_blocks &= ~(1 << i); // Marca que el bloque i ahora es 0 (En memoria)
-	assoofs_save_sb_info(sb); // Funcion auxiliar que guarda en disco la parte persistente del sb
+	*inode_no = __ffs64(~used) + 1;
 	return 0;
 }
 
-/* Guardar la informacion persistente del superbloque a disco */
-void assoofs_save_sb_info(struct super_block *vsb){
-	struct buffer_head *bh; // Se crea un buffer head para leer un bloque
-	struct assoofs_super_block *sb; // Informacion persistente del superbloque en memoria
+/* Devuelve un bloque al mapa de bits. No se sincroniza: el writeback agrupa las liberaciones de muchos borrados */
+void assoofs_sb_free_block(struct super_block *sb, uint64_t block){
+	struct buffer_head *bh;
+	unsigned long *bits;
+	uint64_t first, nbits;
+
+	mutex_lock(&assoofs_sb_lock);
+	bits = assoofs_bitmap_bits(sb, block, &bh, &first, &nbits);
+	if (bits && block - first < nbits) {
+		lock_buffer(bh);
+		__set_bit_le(block - first, bits); // Marca que el bloque ahora es 1 (En memoria)
+		assoofs_bitmap_unlock_dirty(sb, bh, first);
+	}
+	if (bits)
+		brelse(bh);
+	mutex_unlock(&assoofs_sb_lock);
+}
 
-	mutex_lock_interruptible(&assoofs_sb_lock);
-	bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); // Me traigo de disco el bloque del superbloque
-	sb = vsb->s_fs_info; // Cojo la informacion de memoria del parametro
-	bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la informacion en memoria
+/* Cambia inodes_count en la informacion persistente del superbloque (disk apunta dentro de sbh), se escribe en el writeback */
+static void assoofs_sb_add_inodes(struct super_block *vsb, int delta){
+	struct buffer_head *bh = ASSOOFS_SB(vsb)->sbh; // El bloque 0 esta en memoria desde el montaje
 
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
-	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
-	mutex_unlock(&assoofs_sb_lock);
-	brelse(bh); // Se libera el buffer head
+	lock_buffer(bh);
+	ASSOOFS_SB(vsb)->disk->inodes_count += delta;
+	assoofs_meta_unlock_dirty(vsb, bh);
 }
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+/* Guardar la informacion persistente del superbloque a disco */
+void assoofs_save_sb_info(struct super_block *vsb){
+	sync_dirty_buffer(ASSOOFS_SB(vsb)->sbh); // Se sincroniza, los cambios ya se han hecho y sumado con el buffer bloqueado
+}
+
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
 	/*
 	* Argumentos
 	* Puntero al superbloque
-	* Informacion persistente que tiene que llegar al disco (sb->sb_info)
+	* Informacion persistente que tiene que llegar al disco (sb->sb_info), se le pone aqui el numero de inodo
 	*/
 
 	struct buffer_head *bh; // Se crea un buffer head para leer un bloque
 	struct assoofs_inode_info *inode_info;
-	struct assoofs_super_block_info *assoofs_sb = (struct assoofs_super_block_info *)sb->s_fs_info;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->disk;
+	int ret;
 	
-	mutex_lock_interruptible(&assoofs_inodestore_lock);
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
+	/* Elegir el numero y ocupar el hueco en la misma seccion critica: dos create en directorios distintos no pueden coger el mismo */
+	mutex_lock(&assoofs_inodestore_lock);
+	if (assoofs_sb->inodes_count >= ASSOOFS_SB(sb)->max_inodes) { // 64 o lo que quepa en el almacen
+		mutex_unlock(&assoofs_inodestore_lock);
+		return -ENOSPC;
+	}
+	bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
+	if (!bh) {
+		mutex_unlock(&assoofs_inodestore_lock);
+		return -EIO;
+	}
+	ret = assoofs_sb_get_a_freeinode(sb, (struct assoofs_inode_info *)bh->b_data, &inode->inode_no);
+	if (ret) {
+		mutex_unlock(&assoofs_inodestore_lock);
+		brelse(bh);
+		return ret;
+	}
 	inode_info = (struct assoofs_inode_info *)bh->b_data; // Se guarda en una variable el bloque leido (Apuntando al principio)
 	inode_info += assoofs_sb->inodes_count; // Para que apunte al ultimo se avanza el numero de inodos (Apunta justo al final)
+	lock_buffer(bh);
 	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info)); // Copio de memoria en inode_info en inode parametro
+	assoofs_meta_unlock_dirty(sb, bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
 
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
-	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
+	ret = sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
+	if (!ret)
+		assoofs_sb_add_inodes(sb, 1); // Se aumenta el numero de inodos que se tenia
 	mutex_unlock(&assoofs_inodestore_lock);
+	brelse(bh);
+	if (ret)
+		return ret;
 
-	assoofs_sb->inodes_count++; // Se aumenta el numero de inodos que se tenia
 	assoofs_save_sb_info(sb); // Se llama a la funcion que guarda en disco los cambios del sb
+	return 0;
 }
 
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
@@ -419,16 +1393,23 @@ int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *i
 
 	printk(KERN_INFO "assoofs_save_inode_info request.\n");
 	mutex_lock_interruptible(&assoofs_inodestore_lock);
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
+	bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
+	if (!bh) {
+		mutex_unlock(&assoofs_inodestore_lock);
+		return -EIO;
+	}
 	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info); // Se usa una funcion auxiliar para buscar este inodo en el almacen
 
 	if(inode_pos == NULL){
 		printk(KERN_ERR "assoofs error: Inode could not be finded in inode store.\n");
+		mutex_unlock(&assoofs_inodestore_lock);
+		brelse(bh);
 		return -EPERM;	
 	}
 	
+	lock_buffer(bh);
 	memcpy(inode_pos, inode_info, sizeof(*inode_pos)); // Se copia en la posicion la info del parametro
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
+	assoofs_meta_unlock_dirty(sb, bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
 	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
 	mutex_unlock(&assoofs_inodestore_lock);
 
@@ -440,11 +1421,163 @@ int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *i
 	
 }
 
+/* Igual que assoofs_save_inode_info pero sin sincronizar, lo usan los borrados */
+void assoofs_dirty_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+	struct buffer_head *bh;
+	struct assoofs_inode_info *inode_pos;
+
+	mutex_lock(&assoofs_inodestore_lock);
+	bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	if (!bh) {
+		mutex_unlock(&assoofs_inodestore_lock);
+		return;
+	}
+	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+	if (inode_pos != NULL) {
+		lock_buffer(bh);
+		memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+		assoofs_meta_unlock_dirty(sb, bh);
+	}
+	mutex_unlock(&assoofs_inodestore_lock);
+	brelse(bh);
+}
+
+/* Quita un inodo del almacen moviendo el ultimo a su hueco para que el almacen siga compacto */
+void assoofs_remove_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+	struct buffer_head *bh;
+	struct assoofs_inode_info *inode_pos, *last;
+	struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->disk;
+
+	mutex_lock(&assoofs_inodestore_lock);
+	bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+	if (!bh) {
+		mutex_unlock(&assoofs_inodestore_lock);
+		return;
+	}
+	inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+	if (inode_pos == NULL) {
+		printk(KERN_ERR "assoofs error: Inode %llu could not be finded in inode store.\n", inode_info->inode_no);
+		mutex_unlock(&assoofs_inodestore_lock);
+		brelse(bh);
+		return;
+	}
+
+	last = (struct assoofs_inode_info *)bh->b_data + assoofs_sb->inodes_count - 1;
+	lock_buffer(bh);
+	if (inode_pos != last)
+		memcpy(inode_pos, last, sizeof(*inode_pos));
+	memset(last, 0, sizeof(*last));
+	assoofs_meta_unlock_dirty(sb, bh); // Sin sync_dirty_buffer, se escribe en el writeback
+	assoofs_sb_add_inodes(sb, -1);
+	mutex_unlock(&assoofs_inodestore_lock);
+	brelse(bh);
+}
+
+/* Mete en el bloque del directorio padre la entrada nombre-inodo y guarda el nuevo numero de hijos */
+int assoofs_add_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name, uint64_t inode_no){
+	struct buffer_head *bh; // Un buffer head para leer un bloque
+	struct assoofs_dir_record_entry *dir_contents;
+	int ret;
+
+	if (parent_info->dir_children_count >= ASSOOFS_SB(sb)->dir_records_per_block)
+		return -ENOSPC; // El bloque del directorio esta lleno
+
+	mutex_lock(&assoofs_sb_lock);
+	bh = assoofs_bread_meta(sb, parent_info->data_block_number); // Creamos un buffer head para leer el bloque del directorio padre
+	if (!bh) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -EIO;
+	}
+
+	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data; 
+	dir_contents += parent_info->dir_children_count; // Se avanza los hijos que ya tiene hasta el primer hueco libre
+	lock_buffer(bh);
+	dir_contents->inode_no = inode_no;
+	strcpy(dir_contents->filename, name); // Se copia el nombre
+	assoofs_meta_unlock_dirty(sb, bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
+	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
+	mutex_unlock(&assoofs_sb_lock);
+	brelse(bh); // Se libera el buffer head
+
+	parent_info->dir_children_count++;
+	ret = assoofs_save_inode_info(sb, parent_info); // Funcion auxiliar que actualiza la informacion persistente del inodo padre 
+	if (ret)
+		parent_info->dir_children_count--; // La entrada queda en el bloque pero fuera de la cuenta
+	return ret;
+}
+
+/* Quita una entrada del directorio moviendo la ultima a su hueco. Se escribe en el writeback */
+int assoofs_remove_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name){
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record;
+	uint64_t i;
+
+	mutex_lock(&assoofs_sb_lock);
+	bh = assoofs_bread_meta(sb, parent_info->data_block_number);
+	if (!bh) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -EIO;
+	}
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	for (i = 0; i < parent_info->dir_children_count; i++)
+		if (!strcmp(record[i].filename, name))
+			break;
+
+	if (i == parent_info->dir_children_count) {
+		mutex_unlock(&assoofs_sb_lock);
+		brelse(bh);
+		return -ENOENT;
+	}
+
+	parent_info->dir_children_count--;
+	lock_buffer(bh);
+	record[i] = record[parent_info->dir_children_count];
+	memset(&record[parent_info->dir_children_count], 0, sizeof(*record));
+	assoofs_meta_unlock_dirty(sb, bh);
+	mutex_unlock(&assoofs_sb_lock);
+	brelse(bh);
+
+	assoofs_dirty_inode_info(sb, parent_info);
+	return 0;
+}
+
+/* Hace que la entrada name del directorio apunte a inode_no, con un solo cambio del bloque y su suma. Se sincroniza */
+int assoofs_set_dir_record(struct super_block *sb, struct assoofs_inode_info *parent_info, const char *name, uint64_t inode_no){
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record;
+	uint64_t i;
+
+	mutex_lock(&assoofs_sb_lock);
+	bh = assoofs_bread_meta(sb, parent_info->data_block_number);
+	if (!bh) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -EIO;
+	}
+	record = (struct assoofs_dir_record_entry *)bh->b_data;
+	for (i = 0; i < parent_info->dir_children_count; i++)
+		if (!strcmp(record[i].filename, name))
+			break;
+
+	if (i == parent_info->dir_children_count) {
+		mutex_unlock(&assoofs_sb_lock);
+		brelse(bh);
+		return -ENOENT;
+	}
+
+	lock_buffer(bh);
+	record[i].inode_no = inode_no;
+	assoofs_meta_unlock_dirty(sb, bh);
+	sync_dirty_buffer(bh);
+	mutex_unlock(&assoofs_sb_lock);
+	brelse(bh);
+	return 0;
+}
+
 struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
 	uint64_t count = 0;
 
 	//Start es la variable iteradora, si no se corresponde es cuando avanzas y count que no se pase del numero de inodos para parar si no se encuentra 
-	while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
+	while (start->inode_no != search->inode_no && count < ASSOOFS_SB(sb)->disk->inodes_count) {
 		count++;
 		start++;
 	}	
@@ -469,88 +1602,492 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 	struct inode *inode;
 	struct assoofs_inode_info *inode_info;
 	struct super_block *sb;
-	uint64_t count;
-	/* Paso 2 */
 	struct assoofs_inode_info *parent_inode_info;
-	struct assoofs_dir_record_entry *dir_contents;
-	struct buffer_head *bh; // Un buffer head para leer un bloque
+	int ret;
 	
 	printk(KERN_INFO "mkdir request to make %s.\n", dentry->d_name.name);
 	/* 1.- Crear el nuevo inodo */
+	parent_inode_info = dir->i_private; // Informacion persistente del inodo padre
+	if(parent_inode_info->dir_children_count >= ASSOOFS_SB(dir->i_sb)->dir_records_per_block){
+		printk(KERN_ERR "assoofs directory %lu is full.\n", dir->i_ino); //Control de errores
+		return -ENOSPC;
+	}
 	sb = dir->i_sb; //Obtengo el superbloque del directorio padre
-	count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // Obtengo el num inodos de la info persistente del sb
 	inode = new_inode(sb); // Se crea el inodo
-	if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED /* (64) */){
-		printk(KERN_ERR "assoofs can not hold more files. (%lld of %d).\n", count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); //Control de errores
-		return -EPERM;
-	}
-	inode->i_ino = count + 1; // Se le asigna el siguiente numero
+	if(!inode)
+		return -ENOMEM;
 	inode->i_sb = sb; // asignar superbloque al inodo
     inode->i_op = &assoofs_inode_ops; // asignar operaciones al inodo
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // asignar fechas al inodo
 	inode->i_fop=&assoofs_dir_operations; //Es un directorio
 	/* Asignar las propiedades del inodo */
-	inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache)
-	inode_info->inode_no = inode->i_ino;
+	inode_info = kmem_cache_zalloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache), sin tira reservada
+	if(!inode_info){
+		iput(inode);
+		return -ENOMEM;
+	}
 	inode_info->dir_children_count = 0;
 	inode_info->mode = S_IFDIR | mode; // El mode me llega como argumento
 	inode_info->file_size = 0;
 
-	inode->i_private = inode_info; // No inode info
 	inode_init_owner(inode, dir, S_IFDIR | mode);
-	d_add(dentry, inode);
+	inode_info->mode = inode->i_mode; // inode_init_owner puede heredar S_ISGID del padre
+	if(!assoofs_ids_fit(i_uid_read(inode), i_gid_read(inode))){
+		kmem_cache_free(assoofs_inode_cache, inode_info);
+		iput(inode);
+		return -EOVERFLOW;
+	}
+	inode_info->uid = i_uid_read(inode); // El propietario se guarda en disco
+	inode_info->gid = i_gid_read(inode);
+
+	ret = assoofs_alloc_zeroed_block(sb, parent_inode_info->data_block_number, &inode_info->data_block_number, 1); //Funcion auxiliar que busca un bloque libre para el inodo (a ceros y con su suma)
+	if(ret){
+		printk(KERN_ERR "assoofs has no free blocks for directory %s.\n", dentry->d_name.name); //Control de errores
+		kmem_cache_free(assoofs_inode_cache, inode_info);
+		iput(inode);
+		return ret;
+	}
+
+	/* El numero de inodo se elige al meterlo en el almacen, en la misma seccion critica (los de directorios borrados se reutilizan) */
+	ret = assoofs_add_inode_info(sb, inode_info);
+	if(ret){
+		printk(KERN_ERR "assoofs can not hold more files (max %lld).\n", ASSOOFS_SB(sb)->max_inodes); //Control de errores
+		assoofs_sb_free_block(sb, inode_info->data_block_number);
+		kmem_cache_free(assoofs_inode_cache, inode_info);
+		iput(inode);
+		return ret;
+	}
+	inode->i_ino = inode_info->inode_no;
+	inode->i_private = inode_info; // No inode info
+	insert_inode_hash(inode); // Para que assoofs_get_inode lo encuentre en la cache de inodos
+
+	/* 2.- Modificar el contenido del directorio padre para meter el inodo y actualizar su informacion persistente */
+	ret = assoofs_add_dir_record(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no);
+	if(ret){
+		/* Sin enlaces, assoofs_evict_inode devuelve el bloque y lo saca del almacen */
+		clear_nlink(inode);
+		iput(inode);
+		return ret;
+	}
+	d_instantiate(dentry, inode); // lookup ya la metio en el dcache como negativa, d_add la encadenaria dos veces
+
+	assoofs_trace(sb, ASSOOFS_TRACE_MKDIR, inode_info->inode_no, parent_inode_info->inode_no, 0, 0, &dentry->d_name);
+	printk(KERN_INFO "mkdir made successfully (Maked %s).", dentry->d_name.name);
+    return 0; // Todo ha ido bien 
+}
 
-	if(assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number) != 0){ //Funcion auxiliar que busca un bloque libre para el inodo
-		printk(KERN_ERR "assoofs can not hold more files. (%lld of %d).\n", count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED); //Control de errores
-		return -EPERM;
-	} 
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry) {
+	/* 
+	* Parametros
+	* 1- directorio del que se borra el fichero
+	* 2- la entrada en el dir padre de este fichero
+	*/
 
-	assoofs_add_inode_info(sb, inode_info);
+	struct inode *inode = d_inode(dentry);
+	int ret;
 
-	/* 2.- Modificar el contenido del directorio padre para meter el inodo */
-	parent_inode_info = dir->i_private; // Informacion persistente del inodo padre
-	mutex_lock_interruptible(&assoofs_sb_lock);
-	bh = sb_bread(sb, parent_inode_info->data_block_number); // Creamos un buffer head para leer el bloque del directorio padre
+	printk(KERN_INFO "assoofs unlink request for %s.\n", dentry->d_name.name);
+	/* 1.- Quitar la entrada del directorio padre */
+	ret = assoofs_remove_dir_record(dir->i_sb, dir->i_private, dentry->d_name.name);
+	if (ret)
+		return ret;
 
-	dir_contents = (struct assoofs_dir_record_entry *)bh->b_data; 
-	dir_contents += parent_inode_info->dir_children_count; // Se avanza los hijos que ya tiene hasta el primer hueco libre
-	dir_contents->inode_no = inode_info->inode_no; // Se actualiza el numero de hijos
-	strcpy(dir_contents->filename, dentry->d_name.name); // Se copia el nombre
-	
-	mark_buffer_dirty(bh); // Se marca como sucio (Indicar al SO que hay que escribirlo al sacarlo de memoria)
-	sync_dirty_buffer(bh); // Se sincroniza, todos los cambios que haya en bh se llevan a disco
-	mutex_unlock(&assoofs_sb_lock);
-	brelse(bh); // Se libera el buffer head
+	/* 2.- Quitar el enlace. El bloque y el hueco del almacen se recuperan en assoofs_evict_inode cuando se suelte el ultimo uso */
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	inode->i_ctime = dir->i_ctime;
+	drop_nlink(inode);
 
-	/* 3.- Actualizar la informacion persistente del inodo padre */
-	parent_inode_info->dir_children_count++;
-	assoofs_save_inode_info(sb, parent_inode_info); // Funcion auxiliar que actualiza la informacion persistente del inodo padre 
+	printk(KERN_INFO "assoofs unlink successfully %s.\n", dentry->d_name.name);
+	return 0;
+}
 
-	printk(KERN_INFO "mkdir made successfully (Maked %s).", dentry->d_name.name);
-    return 0; // Todo ha ido bien 
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry) {
+	struct inode *inode = d_inode(dentry);
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	int ret;
+
+	printk(KERN_INFO "assoofs rmdir request for %s.\n", dentry->d_name.name);
+	if (inode_info->dir_children_count > 0)
+		return -ENOTEMPTY;
+
+	ret = assoofs_remove_dir_record(dir->i_sb, dir->i_private, dentry->d_name.name);
+	if (ret)
+		return ret;
+
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	inode->i_ctime = dir->i_ctime;
+	clear_nlink(inode);
+
+	printk(KERN_INFO "assoofs rmdir successfully %s.\n", dentry->d_name.name);
+	return 0;
+}
+
+static int assoofs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+	/* 
+	* Parametros
+	* 1- directorio de origen y 2- su entrada
+	* 3- directorio de destino y 4- la entrada nueva (puede existir ya)
+	* 5- flags de renameat2, solo se soporta RENAME_NOREPLACE (lo comprueba el VFS)
+	*/
+
+	struct super_block *sb = old_dir->i_sb;
+	struct inode *inode = d_inode(old_dentry);
+	struct inode *target = d_inode(new_dentry);
+	struct assoofs_inode_info *old_dir_info = old_dir->i_private;
+	struct assoofs_inode_info *new_dir_info = new_dir->i_private;
+	struct buffer_head *bh;
+	struct assoofs_dir_record_entry *record;
+	unsigned int target_nlink;
+	int ret;
+	uint64_t i;
+
+	printk(KERN_INFO "assoofs rename request %s -> %s.\n", old_dentry->d_name.name, new_dentry->d_name.name);
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+
+	/*
+	 * 1.- Si el destino existe (el VFS ya comprobo que son del mismo tipo) su entrada pasa a apuntar al que se mueve, asi en
+	 * ningun momento se queda sin nombre ninguno de los dos. Despues se quita el enlace del destino y por ultimo la entrada vieja
+	 */
+	if (target) {
+		if (S_ISDIR(target->i_mode) && ((struct assoofs_inode_info *)target->i_private)->dir_children_count > 0)
+			return -ENOTEMPTY;
+		ret = assoofs_set_dir_record(sb, new_dir_info, new_dentry->d_name.name, inode->i_ino);
+		if (ret)
+			return ret;
+		target_nlink = target->i_nlink;
+		target->i_ctime = current_time(target);
+		if (S_ISDIR(target->i_mode))
+			clear_nlink(target);
+		else
+			drop_nlink(target);
+		ret = assoofs_remove_dir_record(sb, old_dir_info, old_dentry->d_name.name);
+		if (ret) {
+			/* Se deja como estaba: el destino recupera su entrada y su enlace */
+			if (!assoofs_set_dir_record(sb, new_dir_info, new_dentry->d_name.name, target->i_ino))
+				set_nlink(target, target_nlink);
+			return ret;
+		}
+	} else if (old_dir == new_dir) {
+		/* 2.- En el mismo directorio basta con cambiar el nombre de la entrada */
+		mutex_lock(&assoofs_sb_lock);
+		bh = assoofs_bread_meta(sb, old_dir_info->data_block_number);
+		if (!bh) {
+			mutex_unlock(&assoofs_sb_lock);
+			return -EIO;
+		}
+		record = (struct assoofs_dir_record_entry *)bh->b_data;
+		for (i = 0; i < old_dir_info->dir_children_count; i++, record++) {
+			if (!strcmp(record->filename, old_dentry->d_name.name)) {
+				lock_buffer(bh);
+				memset(record->filename, 0, ASSOOFS_FILENAME_MAXLEN);
+				strcpy(record->filename, new_dentry->d_name.name);
+				assoofs_meta_unlock_dirty(sb, bh);
+				sync_dirty_buffer(bh);
+				break;
+			}
+		}
+		mutex_unlock(&assoofs_sb_lock);
+		brelse(bh);
+		if (i == old_dir_info->dir_children_count)
+			return -ENOENT;
+	} else {
+		/* 3.- Entre directorios se mete en el nuevo antes de quitarlo del viejo, y si no se puede quitar se saca del nuevo */
+		ret = assoofs_add_dir_record(sb, new_dir_info, new_dentry->d_name.name, inode->i_ino);
+		if (ret)
+			return ret;
+		ret = assoofs_remove_dir_record(sb, old_dir_info, old_dentry->d_name.name);
+		if (ret) {
+			assoofs_remove_dir_record(sb, new_dir_info, new_dentry->d_name.name);
+			return ret;
+		}
+	}
+
+	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+	new_dir->i_ctime = new_dir->i_mtime = old_dir->i_ctime;
+	inode->i_ctime = old_dir->i_ctime;
+
+	printk(KERN_INFO "assoofs rename successfully to %s.\n", new_dentry->d_name.name);
+	return 0;
+}
+
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr) {
+	/* chmod, chown y truncate: se cambia el inodo en memoria y se guarda en disco */
+	struct inode *inode = d_inode(dentry);
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode_info *inode_info = inode->i_private;
+	int ret;
+
+	ret = setattr_prepare(dentry, attr); // Permisos y que el tam quepa en s_maxbytes
+	if (ret)
+		return ret;
+	if (((attr->ia_valid & ATTR_UID) && !assoofs_ids_fit(from_kuid(i_user_ns(inode), attr->ia_uid), 0)) ||
+	    ((attr->ia_valid & ATTR_GID) && !assoofs_ids_fit(0, from_kgid(i_user_ns(inode), attr->ia_gid))))
+		return -EOVERFLOW;
+
+	if ((attr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) && attr->ia_size != inode_info->file_size) {
+		if (attr->ia_size < inode_info->file_size) {
+			/* Se devuelven los bloques de detras y se borra la cola para que no reaparezca si el fichero vuelve a crecer */
+			ret = assoofs_truncate_blocks(inode, attr->ia_size);
+			if (ret)
+				return ret;
+		}
+		inode_info->file_size = attr->ia_size;
+		truncate_setsize(inode, attr->ia_size);
+	}
+
+	setattr_copy(inode, attr);
+	inode_info->mode = inode->i_mode;
+	inode_info->uid = i_uid_read(inode);
+	inode_info->gid = i_gid_read(inode);
+	return assoofs_save_inode_info(sb, inode_info);
 }
 
 /*
  *  Operaciones sobre el superbloque
  */
+static void assoofs_put_super(struct super_block *sb);
+static void assoofs_close_members(struct super_block *sb);
+
 static const struct super_operations assoofs_sops = {
-    .drop_inode = assoofs_destroy_inode,
+    .evict_inode = assoofs_evict_inode,
+    .put_super = assoofs_put_super,
 };
 
+static void assoofs_put_super(struct super_block *sb) {
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	printk(KERN_INFO "assoofs put_super request.\n");
+	assoofs_trace_stop(sb);
+	assoofs_close_members(sb);
+	brelse(sbi->sbh); // Se suelta el bloque 0 que se retuvo al montar
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+}
+
+/* Bloques logicos que caben ahora en los dispositivos (cambia con losetup -c o al ampliar un LV); manda el mas pequeño */
+static uint64_t assoofs_device_blocks(struct super_block *sb) {
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t member_blocks = U64_MAX;
+	int i;
+
+	for (i = 0; i < sbi->nr_members; i++)
+		member_blocks = min_t(uint64_t, member_blocks, i_size_read(sbi->members[i]->bd_inode) >> sb->s_blocksize_bits);
+	return ASSOOFS_STRIPE_CAPACITY(member_blocks, sbi->stripe_unit, sbi->nr_members);
+}
+
+/* Amplia el volumen montado hasta new_count bloques, los nuevos quedan libres en el mapa de bits */
+static int assoofs_grow(struct super_block *sb, uint64_t *new_count) {
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	uint64_t device_blocks = assoofs_device_blocks(sb);
+	uint64_t old_count, block, first, nbits;
+	struct buffer_head *bh;
+	unsigned long *bits;
+	int ret;
+
+	if (*new_count == 0)
+		*new_count = device_blocks; // Todo el dispositivo
+	*new_count = min_t(uint64_t, *new_count, ASSOOFS_BITMAP_CAPACITY(sbi->disk)); // Lo que cubre el mapa de bits de mkassoofs
+	if (*new_count > device_blocks)
+		return -ENOSPC;
+
+	mutex_lock(&assoofs_sb_lock);
+	old_count = sbi->blocks_count;
+	if (*new_count < old_count) {
+		mutex_unlock(&assoofs_sb_lock);
+		return -EINVAL; // Encoger no esta soportado
+	}
+	/* Los bloques nuevos se ponen libres con assoofs_sb_lock cogido, nadie los reserva hasta que esten todos */
+	sbi->blocks_count = *new_count; // assoofs_bitmap_bits solo da los bits dentro del volumen
+	for (block = old_count; block < *new_count; block = first + nbits) {
+		bits = assoofs_bitmap_bits(sb, block, &bh, &first, &nbits);
+		if (!bits) {
+			sbi->blocks_count = old_count;
+			mutex_unlock(&assoofs_sb_lock);
+			return -EIO;
+		}
+		lock_buffer(bh);
+		for (; block < first + nbits; block++)
+			__set_bit_le(block - first, bits);
+		assoofs_bitmap_unlock_dirty(sb, bh, first);
+		brelse(bh);
+	}
+	lock_buffer(sbi->sbh);
+	sbi->disk->blocks_count = *new_count;
+	assoofs_meta_unlock_dirty(sb, sbi->sbh);
+	mutex_unlock(&assoofs_sb_lock);
+
+	/* Los bloques nuevos se pueden usar ya, pero solo si el mapa de bits y el superbloque han llegado a disco */
+	ret = assoofs_sync_free_space(sb);
+	if (ret)
+		return ret;
+	printk(KERN_INFO "assoofs grown from %llu to %llu blocks.\n", old_count, *new_count);
+	return 0;
+}
+
+static long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct super_block *sb = file_inode(filp)->i_sb;
+	uint64_t __user *argp = (uint64_t __user *)arg;
+	uint64_t count;
+	int ret;
+
+	switch (cmd) {
+	case ASSOOFS_IOC_GROW:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(count, argp))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp); // No se puede crecer un montaje de solo lectura
+		if (ret)
+			return ret;
+		ret = assoofs_grow(sb, &count);
+		mnt_drop_write_file(filp);
+		if (ret)
+			return ret;
+		return put_user(count, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+void assoofs_evict_inode(struct inode *inode) {
+	struct assoofs_inode_info *inode_info = inode->i_private;
+
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	if (inode_info == NULL)
+		return;
+
+	if (S_ISREG(inode_info->mode))
+		assoofs_discard_prealloc(inode); // Lo que no se llego a usar de la tira reservada
+
+	/* Si ya no quedan enlaces se devuelven sus bloques y su hueco del almacen de inodos (se escriben en el writeback) */
+	if (!inode->i_nlink) {
+		printk(KERN_INFO "Reclaiming block %llu and inode %llu.\n", inode_info->data_block_number, inode_info->inode_no);
+		if (S_ISREG(inode_info->mode))
+			assoofs_truncate_blocks(inode, 0); // Los datos y el mapa
+		else if (inode_info->data_block_number != ASSOOFS_UNALLOCATED_BLOCK)
+			assoofs_sb_free_block(inode->i_sb, inode_info->data_block_number);
+		assoofs_remove_inode_info(inode->i_sb, inode_info);
+	}
+
+	printk(KERN_INFO "Freeing private data of inode %p ( %lu).\n", inode_info, inode->i_ino);
+	kmem_cache_free(assoofs_inode_cache, inode_info);
+	inode->i_private = NULL;
+}
+
 /*
  *  Inicialización del superbloque
  */
+/* Opciones de montaje (-o): trace activa la traza de operaciones y devices=/dev/b:/dev/c da el resto de dispositivos del volumen */
+static int assoofs_parse_options(char *options, int *trace, char **devices) {
+    char *p;
+
+    *trace = 0;
+    *devices = NULL;
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        if (!strcmp(p, "trace")) {
+            *trace = 1;
+        } else if (!strncmp(p, "devices=", 8)) {
+            *devices = p + 8;
+        } else {
+            printk(KERN_ERR "Unknown assoofs mount option %s.\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/* Abre los dispositivos 1.. del volumen en el orden de devices y comprueba que cada uno es el que toca */
+static int assoofs_open_members(struct super_block *sb, char *devices) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *member;
+    struct block_device *bdev;
+    struct buffer_head *bh;
+    char *path;
+    int ok;
+
+    sbi->members[0] = sb->s_bdev;
+    sbi->nr_members = 1;
+    sbi->stripe_unit = ASSOOFS_STRIPE_UNIT(sbi->disk);
+    sbi->member_mode = FMODE_READ | FMODE_EXCL | (sb_rdonly(sb) ? 0 : FMODE_WRITE);
+
+    while ((path = strsep(&devices, ":")) != NULL) {
+        if (!*path)
+            continue;
+        if (sbi->nr_members >= ASSOOFS_STRIPE_DEVICES(sbi->disk)) {
+            printk(KERN_ERR "The assoofs volume only has %llu devices.\n", ASSOOFS_STRIPE_DEVICES(sbi->disk));
+            return -EINVAL;
+        }
+        bdev = blkdev_get_by_path(path, sbi->member_mode, sb->s_type);
+        if (IS_ERR(bdev)) {
+            printk(KERN_ERR "Could not open the assoofs device %s.\n", path);
+            return PTR_ERR(bdev);
+        }
+        sbi->members[sbi->nr_members++] = bdev; // Desde aqui lo suelta assoofs_close_members
+        if (set_blocksize(bdev, sb->s_blocksize))
+            return -EINVAL;
+
+        bh = __bread(bdev, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, sb->s_blocksize);
+        if (!bh)
+            return -EIO;
+        member = (struct assoofs_super_block_info *)bh->b_data;
+        ok = member->magic == ASSOOFS_MAGIC && member->stripe_id == sbi->disk->stripe_id &&
+             member->stripe_index == sbi->nr_members - 1 &&
+             (!sbi->checksums || assoofs_checksum_ok(sb->s_blocksize, bh->b_data));
+        brelse(bh);
+        if (!ok) {
+            printk(KERN_ERR "%s is not device %d of this assoofs volume.\n", path, sbi->nr_members - 1);
+            return -EINVAL;
+        }
+    }
+
+    if (sbi->nr_members != ASSOOFS_STRIPE_DEVICES(sbi->disk)) {
+        printk(KERN_ERR "The assoofs volume has %llu devices but %d were given (-o devices=).\n",
+               ASSOOFS_STRIPE_DEVICES(sbi->disk), sbi->nr_members);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* s_bdev lo escribe y lo suelta kill_block_super, el resto de dispositivos se sincronizan y se sueltan aqui */
+static void assoofs_close_members(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    int i;
+
+    for (i = 1; i < sbi->nr_members; i++) {
+        sync_blockdev(sbi->members[i]);
+        invalidate_bdev(sbi->members[i]);
+        blkdev_put(sbi->members[i], sbi->member_mode);
+    }
+    sbi->nr_members = 0;
+}
+
 int assoofs_fill_super(struct super_block *sb, void *data, int silent) {   
 
     struct buffer_head *bh; // Un struct buffer head es un bloque
     struct assoofs_super_block_info *assoofs_sb; // assoofs superblock info (hecha por nosotros)
+    struct assoofs_sb_info *sbi; // Lo que se guarda en s_fs_info
+    uint64_t block_size, meta_size;
 
     struct inode *root_inode; // Variable necesaria en el paso 4 (Es un inodo)
+    int trace, ret;
+    char *devices;
 
     printk(KERN_INFO "assoofs fill superblock request.\n");
+    if(assoofs_parse_options(data, &trace, &devices))
+        return -EINVAL;
+
     /* 1.- Leer la información persistente del superbloque del dispositivo de bloques */
     // sb lo recibe assoofs_fill_super como argumento y es un puntero a una variable superbloque en memoria y ASSOOFS_SUPERBLOCK_NUMBER es un numero del 0 al 63 (El del superbloque es 0)
+    // Todavia no se sabe el tam de bloque, se lee con el del dispositivo: la parte persistente esta al principio del bloque 0
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);  //Sin mutex, no habra accesos concurrentes al llenar el superbloque
+    if(unlikely(!bh)){
+        printk(KERN_ERR "Could not read the assoofs superblock.\n");
+        return -EIO;
+    }
     assoofs_sb = (struct assoofs_super_block_info *)bh->b_data; // En assoofs_sb se mete solo b_data que es (void*) y se castea.
     printk(KERN_INFO "Loaded superblock correctly from disk.\n");
 
@@ -560,35 +2097,129 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
         printk(KERN_ERR "The filesystem is not a assoofs, magic numbers does not match.\n");
         brelse(bh);
         return -1;
-    } else if(unlikely(assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE)){
-        /* Si el tamaño de bloque leido del superbloque no se corresponde con el marcado en el .h se lanza un error */
-        printk(KERN_ERR "The block size is not %u, could not iniciate assoofs.\n", ASSOOFS_DEFAULT_BLOCK_SIZE);
+    } else if(unlikely(!ASSOOFS_VALID_BLOCK_SIZE(assoofs_sb->block_size))){
+        /* El tamaño de bloque lo elige mkassoofs, tiene que ser potencia de 2 entre 1 KiB y 64 KiB */
+        printk(KERN_ERR "The block size %llu is not supported, could not iniciate assoofs.\n", assoofs_sb->block_size);
         brelse(bh);
         return -1;
     }
     printk(KERN_INFO "assoofs v%llu correctly formatted.\n", assoofs_sb->version);
 
+    /* Se cambia al tam de bloque del sistema de ficheros y se vuelve a leer el bloque 0 entero */
+    block_size = assoofs_sb->block_size;
+    if(sb->s_blocksize != block_size){
+        brelse(bh);
+        if(!sb_set_blocksize(sb, block_size)){
+            /* Falla si el dispositivo no lo admite o si es mayor que una pagina */
+            printk(KERN_ERR "The device does not support %llu byte blocks.\n", block_size);
+            return -EINVAL;
+        }
+        bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+        if(unlikely(!bh)){
+            printk(KERN_ERR "Could not read the assoofs superblock.\n");
+            return -EIO;
+        }
+        assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
+    }
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if(!sbi){
+        brelse(bh);
+        return -ENOMEM;
+    }
+    sbi->sbh = bh; // No se libera hasta assoofs_put_super
+    INIT_LIST_HEAD(&sbi->prealloc);
+    sbi->disk = assoofs_sb;
+    meta_size = ASSOOFS_META_SIZE(assoofs_sb); // Sin los 4 bytes de la suma si el formato la lleva
+    sbi->dir_records_per_block = ASSOOFS_DIR_RECORDS_PER_BLOCK(meta_size);
+    sbi->max_inodes = ASSOOFS_MAX_INODES(meta_size);
+    sbi->blockmap = assoofs_sb->version >= ASSOOFS_BLOCKMAP_VERSION;
+    sbi->blocks_per_file = sbi->blockmap ? ASSOOFS_BLOCKMAP_ENTRIES(meta_size) : 1;
+    sbi->blocks_count = ASSOOFS_BLOCKS_COUNT(assoofs_sb);
+    sbi->checksums = assoofs_sb->version >= ASSOOFS_CHECKSUM_VERSION;
+    sbi->bitmap = assoofs_sb->version >= ASSOOFS_BITMAP_VERSION;
+    sbi->bitmap_bits = ASSOOFS_BITMAP_BITS(meta_size);
+    sb->s_fs_info = sbi; // Para no tener que hacer tantos accesos a discos se guarda en el campo s.fs.info de sb
+
+    /* El bloque 0 se ha leido con sb_bread, su suma se comprueba aqui y el resto de lecturas ya lo ven verificado */
+    if(sbi->checksums){
+        if(!assoofs_checksum_ok(block_size, bh->b_data)){
+            printk(KERN_ERR "assoofs checksum mismatch in the superblock, run fsck.assoofs.\n");
+            ret = -EIO;
+            goto failed;
+        }
+        set_buffer_verified(bh);
+    }
+
+    /* Las busquedas en el almacen recorren inodes_count entradas, no pueden salirse del bloque 1 */
+    if(assoofs_sb->inodes_count > sbi->max_inodes){
+        printk(KERN_ERR "assoofs superblock claims %llu inodes, the inode store holds %llu. Run fsck.assoofs.\n", assoofs_sb->inodes_count, sbi->max_inodes);
+        ret = -EINVAL;
+        goto failed;
+    }
+
+    /* Con striping el superbloque que vale es el del dispositivo 0, los demas se abren con -o devices= */
+    if(assoofs_sb->stripe_index != 0 || ASSOOFS_STRIPE_DEVICES(assoofs_sb) > ASSOOFS_MAX_STRIPE_DEVICES){
+        printk(KERN_ERR "This is device %llu of a striped assoofs volume, mount device 0.\n", assoofs_sb->stripe_index);
+        ret = -EINVAL;
+        goto failed;
+    }
+    /* El mapa de bits tiene que ir detras de los bloques fijos y cubrir todo el volumen */
+    if(sbi->bitmap && (assoofs_sb->bitmap_block <= ASSOOFS_LAST_RESERVED_BLOCK || assoofs_sb->bitmap_blocks == 0 ||
+                       assoofs_sb->bitmap_block + assoofs_sb->bitmap_blocks > sbi->blocks_count ||
+                       sbi->blocks_count > ASSOOFS_BITMAP_CAPACITY(assoofs_sb))){
+        printk(KERN_ERR "assoofs free space bitmap (%llu blocks at %llu) is invalid, run fsck.assoofs.\n",
+               assoofs_sb->bitmap_blocks, assoofs_sb->bitmap_block);
+        ret = -EINVAL;
+        goto failed;
+    }
+    if(!sbi->bitmap && sbi->blocks_count > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+        printk(KERN_ERR "assoofs v%llu volumes can not have more than %d blocks.\n", assoofs_sb->version, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+        ret = -EINVAL;
+        goto failed;
+    }
+    ret = assoofs_open_members(sb, devices);
+    if(ret)
+        goto failed;
+    if(sbi->blocks_count > assoofs_device_blocks(sb)){
+        /* El dispositivo ha encogido, los ultimos bloques no existen */
+        printk(KERN_ERR "The device is smaller than the filesystem (%llu blocks).\n", sbi->blocks_count);
+        ret = -EINVAL;
+        goto failed;
+    }
+
     /* 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb (memoria), incluído el campo s_op con las operaciones que soporta. */
     sb->s_magic = ASSOOFS_MAGIC;
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = sbi->blocks_per_file * block_size; // Lo que cabe en el mapa de un fichero, sin niveles indirectos
+    printk(KERN_INFO "assoofs files are limited to %lld bytes (one block map level).\n", (long long)sb->s_maxbytes);
     sb->s_op = &assoofs_sops; 
-    sb->s_fs_info = assoofs_sb; // Para no tener que hacer tantos accesos a discos se guarda en el campo s.fs.info de sb
 
     /* 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop) */
-    root_inode = new_inode(sb);
-    // Se asignan permisos. Params: inodo, propietario y permisos (S_IFDIR si es directorio o S_IFREG si es fichero)
-    inode_init_owner(root_inode, NULL, S_IFDIR); 
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER; // Numero de inodo (1)
-    root_inode->i_sb = sb;  // Puntero al superbloque
-    root_inode->i_op = &assoofs_inode_ops; // Operaciones para trabajar con inodos
-    root_inode->i_fop = &assoofs_dir_operations; // Operaciones dependiendo si es dir o file
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // Fecha de ultimo acceso, modificacion y creacion
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); // Información persistente del inodo
+    // Se construye como cualquier otro inodo (1) para que quede en la cache de inodos con el modo y el propietario del disco
+    root_inode = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if(IS_ERR(root_inode)){
+        ret = PTR_ERR(root_inode);
+        goto failed;
+    }
     sb->s_root = d_make_root(root_inode); // Asignar el inodo a la jerarquia (Solo para el root)
+    if(!sb->s_root){
+        ret = -ENOMEM;
+        goto failed;
+    }
 
-    brelse(bh); // Se libera el buffer_head
+    /* 5.- Con s_root ya puesto, si falla la traza put_super libera todo al desmontar */
+    if(trace)
+        return assoofs_trace_start(sb);
 
     return 0; // Se devuelve un 0 que indica que todo esta bien
+
+failed:
+    /* Sin raiz no se llama a put_super, se libera aqui */
+    assoofs_close_members(sb);
+    brelse(sbi->sbh);
+    kfree(sbi);
+    sb->s_fs_info = NULL;
+    return ret;
 }
 
 
@@ -596,19 +2227,27 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
     // Acceder al disco para leer el bloque que contiene el almacen de inodos
     struct assoofs_inode_info *inode_info = NULL;
     struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
+    struct assoofs_super_block_info *afs_sb = ASSOOFS_SB(sb)->disk;
     struct assoofs_inode_info *buffer = NULL;
     int i;
 
     mutex_lock_interruptible(&assoofs_inodestore_lock);
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
+	bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); // Se lee de disco el bloque que contiene el almacen de inodos (1)
 	mutex_unlock(&assoofs_inodestore_lock);
+    if (!bh)
+        return NULL;
     inode_info = (struct assoofs_inode_info *)bh->b_data;
     /* En bucle se busca en el almacen desde 0 al ultimo inodo si coincide con nuestro parametro */
     for(i = 0; i < afs_sb->inodes_count; i++){
         if(inode_info->inode_no == inode_no){
-            buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache)
-            memcpy(buffer, inode_info, sizeof(*buffer));
+            /* lookup e iterate recorren dir_children_count entradas del bloque, no pueden ser mas de las que caben */
+            if (S_ISDIR(inode_info->mode) && inode_info->dir_children_count > ASSOOFS_SB(sb)->dir_records_per_block) {
+                printk(KERN_ERR "assoofs directory inode %llu claims %llu children, run fsck.assoofs.\n", inode_no, inode_info->dir_children_count);
+                break;
+            }
+            buffer = kmem_cache_zalloc(assoofs_inode_cache, GFP_KERNEL); // Reservamos memoria (En cache), sin tira reservada
+            if (buffer)
+                memcpy(buffer, inode_info, sizeof(*buffer));
             break;
         }
         inode_info++;
@@ -645,7 +2284,7 @@ static struct file_system_type assoofs_type = {
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = kill_block_super, // Viene de mount_bdev, hay que soltar el dispositivo
 };
 
 static int __init assoofs_init(void) {
@@ -654,7 +2293,8 @@ static int __init assoofs_init(void) {
 
     printk(KERN_INFO "assoofs_init request.\n");
     ret = register_filesystem(&assoofs_type);
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), NULL);
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), NULL);
+    assoofs_debugfs_root = debugfs_create_dir("assoofs", NULL); // Aqui cuelgan las trazas de los montajes con -o trace
 
     /* Control de errores */
     if(ret != 0)
@@ -672,6 +2312,7 @@ static void __exit assoofs_exit(void) {
     printk(KERN_INFO "assoofs_exit request\n");
     ret = unregister_filesystem(&assoofs_type);
     kmem_cache_destroy(assoofs_inode_cache);
+    debugfs_remove_recursive(assoofs_debugfs_root);
 
     /* Control de errores */
     if(ret != 0)
@@ -682,3 +2323,4 @@ static void __exit assoofs_exit(void) {
 
 module_init(assoofs_init);
 module_exit(assoofs_exit);
+MODULE_LICENSE("GPL"); // mnt_want_write_file, debugfs y ktime_get_ns solo se exportan a modulos GPL
@@ -1,11 +1,22 @@
 #define ASSOOFS_MAGIC 0x20200406
+#define ASSOOFS_VERSION 5
+#define ASSOOFS_OWNERSHIP_VERSION 2 /* Desde esta version el inodo guarda uid y gid */
+#define ASSOOFS_BLOCKMAP_VERSION 3  /* Desde esta version data_block_number de un fichero apunta a su mapa de bloques */
+#define ASSOOFS_CHECKSUM_VERSION 4  /* Desde esta version los bloques de metadatos acaban en un crc32c */
+#define ASSOOFS_BITMAP_VERSION 5    /* Desde esta version el mapa de bits de bloques libres va en sus propios bloques */
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
+#define ASSOOFS_MIN_BLOCK_SIZE 1024
+#define ASSOOFS_MAX_BLOCK_SIZE 65536
+#define ASSOOFS_VALID_BLOCK_SIZE(size) ((size) >= ASSOOFS_MIN_BLOCK_SIZE && (size) <= ASSOOFS_MAX_BLOCK_SIZE && ((size) & ((size) - 1)) == 0)
 #define ASSOOFS_FILENAME_MAXLEN 255
+#define ASSOOFS_MAX_STRIPE_DEVICES 8
+#define ASSOOFS_MAX_STRIPE_UNIT 4096 /* Bloques seguidos en un dispositivo como mucho (16 MiB con bloques de 4 KiB) */
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
 const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
+const int ASSOOFS_UNALLOCATED_BLOCK = 0; /* data_block_number de un fichero sin bloque (nunca el superbloque) */
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
 const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
 
@@ -14,9 +25,15 @@ struct assoofs_super_block_info {
     uint64_t magic;
     uint64_t block_size;    
     uint64_t inodes_count;
-    uint64_t free_blocks;
-    char padding[4056];
-};
+    uint64_t free_blocks;   /* Mapa de bits de los 64 bloques antes de ASSOOFS_BITMAP_VERSION, despues no se usa */
+    uint64_t blocks_count;  /* Bloques que gestiona el mapa de bits, 0 en imagenes antiguas (todos) */
+    uint64_t stripe_devices; /* Dispositivos del volumen, 0 o 1 sin striping */
+    uint64_t stripe_unit;   /* Bloques seguidos en un dispositivo antes de pasar al siguiente */
+    uint64_t stripe_index;  /* Posicion de este dispositivo en el volumen, el 0 tiene el superbloque que se usa */
+    uint64_t stripe_id;     /* Igual en todos los dispositivos de un volumen */
+    uint64_t bitmap_block;  /* Primer bloque del mapa de bits (ASSOOFS_BITMAP_VERSION) */
+    uint64_t bitmap_blocks; /* Bloques del mapa de bits, limitan hasta donde puede crecer el volumen */
+}; /* El resto del bloque 0 (block_size bytes) va a ceros */
 
 struct assoofs_dir_record_entry {
     char filename[ASSOOFS_FILENAME_MAXLEN];
@@ -25,6 +42,8 @@ struct assoofs_dir_record_entry {
 
 struct assoofs_inode_info {
     mode_t mode;
+    uint16_t uid;   /* Ocupan el hueco de alineacion que habia tras mode */
+    uint16_t gid;
     uint64_t inode_no;
     uint64_t data_block_number;
     union {
@@ -32,3 +51,79 @@ struct assoofs_inode_info {
         uint64_t dir_children_count;
     };
 };
+
+/*
+ * Sumas de comprobacion: superbloque, almacen de inodos, directorios y mapas de bloques guardan en sus ultimos 4 bytes
+ * el crc32c (semilla ~0, sin invertir al final) del resto del bloque. Los bloques de datos no llevan suma.
+ */
+#define ASSOOFS_CHECKSUM_OFFSET(block_size) ((block_size) - sizeof(uint32_t))
+#define ASSOOFS_META_SIZE(sb) ((sb)->version >= ASSOOFS_CHECKSUM_VERSION ? ASSOOFS_CHECKSUM_OFFSET((sb)->block_size) : (sb)->block_size)
+
+/* Capacidades por bloque, dependen del block_size elegido por mkassoofs (a las macros se les pasa ASSOOFS_META_SIZE) */
+#define ASSOOFS_DIR_RECORDS_PER_BLOCK(block_size) ((block_size) / sizeof(struct assoofs_dir_record_entry))
+#define ASSOOFS_INODES_PER_BLOCK(block_size) ((block_size) / sizeof(struct assoofs_inode_info))
+/*
+ *  El mapa de bloques de un fichero es un unico bloque sin niveles indirectos, asi que un fichero no pasa de
+ *  ASSOOFS_BLOCKMAP_ENTRIES bloques: 2 MiB con bloques de 4 KiB (menos con la suma), 128 KiB con 1 KiB. Es a proposito, los
+ *  volumenes de assoofs son de unos pocos MiB; escribir mas alla da EFBIG. Un mapa de mapas cambiaria el formato.
+ */
+#define ASSOOFS_BLOCKMAP_ENTRIES(block_size) ((block_size) / sizeof(uint64_t)) /* Bloques por fichero, 0 es un hueco */
+#define ASSOOFS_BLOCKS_COUNT(sb) ((sb)->blocks_count ? (sb)->blocks_count : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+#define ASSOOFS_BLOCKS_MASK(count) ((count) >= 64 ? ~0ULL : (1ULL << (count)) - 1) /* Bits de free_blocks dentro del volumen */
+/*
+ * Mapa de bits de bloques libres (ASSOOFS_BITMAP_VERSION): bitmap_blocks bloques de metadatos seguidos desde bitmap_block,
+ * el bit b (bit b % 8 del byte b / 8) a 1 si el bloque b esta libre. Cada bloque cubre los bits que caben sin la suma.
+ */
+#define ASSOOFS_BITMAP_BITS(block_size) ((block_size) * 8) /* Bloques que cubre cada bloque del mapa, se le pasa ASSOOFS_META_SIZE */
+#define ASSOOFS_BITMAP_CAPACITY(sb) ((sb)->version >= ASSOOFS_BITMAP_VERSION ? \
+                                     (sb)->bitmap_blocks * ASSOOFS_BITMAP_BITS(ASSOOFS_META_SIZE(sb)) : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+#define ASSOOFS_STRIPE_DEVICES(sb) ((sb)->stripe_devices ? (sb)->stripe_devices : 1)
+#define ASSOOFS_STRIPE_UNIT(sb) ((sb)->stripe_unit ? (sb)->stripe_unit : 1)
+/*
+ * Striping: cada dispositivo guarda en su bloque 0 una copia del superbloque con su stripe_index y el bloque logico 0 es
+ * el del dispositivo 0. El resto de bloques logicos se reparten por turnos, en unidades de stripe_unit bloques, a partir
+ * del bloque 1 de cada dispositivo. Con un solo dispositivo el bloque logico y el fisico coinciden.
+ */
+#define ASSOOFS_STRIPE_MEMBER(block, unit, n) ((block) == 0 ? 0 : (((block) - 1) / (unit)) % (n))
+#define ASSOOFS_STRIPE_OFFSET(block, unit, n) ((block) == 0 ? 0 : 1 + (((block) - 1) / (unit)) / (n) * (unit) + ((block) - 1) % (unit))
+#define ASSOOFS_STRIPE_CAPACITY(member_blocks, unit, n) ((member_blocks) ? 1 + (n) * (((member_blocks) - 1) / (unit) * (unit)) : 0)
+#define ASSOOFS_MAX_INODES(block_size) (ASSOOFS_INODES_PER_BLOCK(block_size) < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ? \
+                                        ASSOOFS_INODES_PER_BLOCK(block_size) : ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+
+/* Crecimiento en caliente: se pasa el nuevo numero de bloques (0 = todo el dispositivo) y se devuelve el resultante */
+#define ASSOOFS_IOC_GROW _IOWR('a', 1, uint64_t)
+
+/* Traza de operaciones (montaje con -o trace), se lee en /sys/kernel/debug/assoofs/<dispositivo>/trace */
+#define ASSOOFS_TRACE_LOOKUP 1
+#define ASSOOFS_TRACE_CREATE 2
+#define ASSOOFS_TRACE_MKDIR 3
+#define ASSOOFS_TRACE_READ 4
+#define ASSOOFS_TRACE_WRITE 5
+#define ASSOOFS_TRACE_ITERATE 6
+#define ASSOOFS_TRACE_NAME_LEN 32
+
+struct assoofs_trace_record {
+    uint64_t time_ns;   /* Desde el montaje */
+    uint64_t ino;       /* Inodo de la operacion; en lookup/create/mkdir el resultado (0 si no existe) */
+    uint64_t parent;    /* Directorio de lookup/create/mkdir */
+    uint64_t offset;    /* Posicion en read/write/iterate */
+    uint32_t len;       /* Bytes pedidos en read/write */
+    uint16_t op;
+    uint16_t name_len;  /* Longitud real del nombre, solo se guardan los ASSOOFS_TRACE_NAME_LEN primeros bytes */
+    char name[ASSOOFS_TRACE_NAME_LEN];
+};
+
+#ifndef __KERNEL__
+/* crc32c para las herramientas, el modulo usa el del kernel (crc32c(), con SSE4.2 o PCLMUL si los hay) */
+static inline uint32_t assoofs_crc32c(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    return crc;
+}
+#endif
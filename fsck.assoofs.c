@@ -0,0 +1,566 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assoofs.h"
+
+/* Codigos de salida (los mismos que usa e2fsck) */
+#define FSCK_OK 0
+#define FSCK_NONDESTRUCT 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* Prioridad de E/S minima para el modo scrub (ioprio_set no tiene wrapper en glibc) */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct fsck_state {
+    char *images[ASSOOFS_MAX_STRIPE_DEVICES]; // Dispositivos del volumen mapeados en memoria
+    off_t lens[ASSOOFS_MAX_STRIPE_DEVICES];
+    int fds[ASSOOFS_MAX_STRIPE_DEVICES];
+    uint64_t ndevices;
+    uint64_t stripe_unit;
+    uint64_t block_size;    // Tam de bloque del superbloque
+    uint64_t nblocks;       // Bloques del volumen (blocks_count, limitado a lo que cabe en el dispositivo)
+    int blockmap;           // Los ficheros tienen mapa de bloques (version >= ASSOOFS_BLOCKMAP_VERSION)
+    int checksums;          // Los bloques de metadatos llevan crc32c (version >= ASSOOFS_CHECKSUM_VERSION)
+    uint64_t meta_size;     // Lo que queda de un bloque de metadatos sin su suma
+    unsigned char *meta_blocks; // Mapa de bits de los bloques de metadatos revisados, se les rehace la suma al reparar
+    uint64_t max_file_size; // Lo que cabe en un fichero: su mapa entero o un solo bloque
+    int repair;             // Se pueden escribir correcciones
+    int errors;             // Errores encontrados
+    int fixed;              // Errores corregidos
+    struct assoofs_super_block_info *sb;
+    struct assoofs_inode_info *store;
+    uint64_t ninodes;       // Entradas del almacen que se recorren: inodes_count limitado al almacen aunque no se repare
+    unsigned char *used_blocks; // Mapa de bits de bloques realmente ocupados (nblocks bits)
+    int bitmap;             // Mapa de bits en bloques propios (version >= ASSOOFS_BITMAP_VERSION), si no free_blocks
+    uint64_t referenced;    // Mapa de bits de inodos enlazados desde algun directorio (bit inode_no - 1)
+};
+
+/* Bloque logico: con striping esta en el dispositivo y la posicion que dice ASSOOFS_STRIPE_OFFSET */
+static void *get_block(struct fsck_state *st, uint64_t block) {
+    return st->images[ASSOOFS_STRIPE_MEMBER(block, st->stripe_unit, st->ndevices)] +
+           ASSOOFS_STRIPE_OFFSET(block, st->stripe_unit, st->ndevices) * st->block_size;
+}
+
+/* Mapas de bits de fsck, un bit por bloque del volumen con el mismo orden que el del disco */
+static int test_block(const unsigned char *map, uint64_t block) {
+    return (map[block / 8] >> (block % 8)) & 1;
+}
+
+static void set_block(unsigned char *map, uint64_t block) {
+    map[block / 8] |= 1 << (block % 8);
+}
+
+/* Anota un error y devuelve si se debe corregir */
+static int report(struct fsck_state *st, const char *msg, unsigned long long a, unsigned long long b) {
+    st->errors++;
+    printf(msg, a, b);
+    if (st->repair) {
+        st->fixed++;
+        printf(" Fixed.\n");
+    } else {
+        printf("\n");
+    }
+    return st->repair;
+}
+
+static uint32_t *block_checksum(struct fsck_state *st, void *block) {
+    return (uint32_t *)((char *)block + ASSOOFS_CHECKSUM_OFFSET(st->block_size));
+}
+
+/* Comprueba la suma de un bloque de metadatos. Si no cuadra no se toca aqui: se rehace al final si se ha reparado algo */
+static void check_checksum(struct fsck_state *st, void *block, uint64_t n, const char *msg) {
+    uint32_t crc;
+
+    if (!st->checksums)
+        return;
+    crc = assoofs_crc32c(~0U, block, st->meta_size);
+    if (crc != *block_checksum(st, block))
+        report(st, msg, n, *block_checksum(st, block));
+}
+
+static void check_meta_block(struct fsck_state *st, uint64_t block_no) {
+    if (block_no >= st->nblocks)
+        return; // Lo denuncia quien lo referencia
+    set_block(st->meta_blocks, block_no);
+    check_checksum(st, get_block(st, block_no), block_no, "Metadata block %llu has a bad checksum %#llx.");
+}
+
+/* Con algo corregido se vuelven a sumar todos los bloques de metadatos revisados, esten o no tocados */
+static void write_checksums(struct fsck_state *st) {
+    uint64_t i;
+
+    if (!st->checksums || !st->repair || !st->fixed)
+        return;
+    for (i = 0; i < st->nblocks; i++) {
+        if (test_block(st->meta_blocks, i))
+            *block_checksum(st, get_block(st, i)) = assoofs_crc32c(~0U, get_block(st, i), st->meta_size);
+    }
+    for (i = 1; i < st->ndevices; i++)
+        *block_checksum(st, st->images[i]) = assoofs_crc32c(~0U, st->images[i], st->meta_size);
+}
+
+static struct assoofs_inode_info *find_inode(struct fsck_state *st, uint64_t inode_no) {
+    uint64_t i;
+
+    for (i = 0; i < st->ninodes; i++)
+        if (st->store[i].inode_no == inode_no)
+            return &st->store[i];
+    return NULL;
+}
+
+/* Los numeros de inodo van de 1 a 64 (bit inode_no - 1 de referenced) */
+static int valid_inode_no(uint64_t inode_no) {
+    return inode_no > 0 && inode_no <= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+}
+
+static int is_referenced(struct fsck_state *st, uint64_t inode_no) {
+    return (st->referenced & (1ULL << (inode_no - 1))) != 0;
+}
+
+/* Quita la entrada i del almacen de inodos moviendo la ultima a su hueco */
+static void drop_inode(struct fsck_state *st, uint64_t i) {
+    st->ninodes--;
+    st->sb->inodes_count = st->ninodes;
+    st->store[i] = st->store[st->ninodes];
+    memset(&st->store[st->ninodes], 0, sizeof(*st->store));
+}
+
+static int check_superblock(struct fsck_state *st) {
+    struct assoofs_super_block_info *member;
+    uint64_t max_inodes, i, member_blocks = UINT64_MAX;
+
+    if (st->sb->magic != ASSOOFS_MAGIC) {
+        printf("Bad magic number %#llx, not an assoofs filesystem.\n", (unsigned long long)st->sb->magic);
+        return -1;
+    }
+    if (!ASSOOFS_VALID_BLOCK_SIZE(st->sb->block_size)) {
+        printf("Unsupported block size %llu.\n", (unsigned long long)st->sb->block_size);
+        return -1;
+    }
+
+    st->block_size = st->sb->block_size;
+    st->checksums = st->sb->version >= ASSOOFS_CHECKSUM_VERSION;
+    st->meta_size = ASSOOFS_META_SIZE(st->sb);
+
+    /* Con striping hacen falta todos los dispositivos, en orden, y cada uno tiene que ser del mismo volumen */
+    if (st->sb->stripe_index != 0 || ASSOOFS_STRIPE_DEVICES(st->sb) != st->ndevices) {
+        printf("This is device %llu of a %llu device volume, give all of them in order.\n",
+               (unsigned long long)st->sb->stripe_index, (unsigned long long)ASSOOFS_STRIPE_DEVICES(st->sb));
+        return -1;
+    }
+    for (i = 0; i < st->ndevices; i++) {
+        member = (struct assoofs_super_block_info *)st->images[i];
+        if (i > 0 && (member->magic != ASSOOFS_MAGIC || member->stripe_id != st->sb->stripe_id || member->stripe_index != i)) {
+            printf("Device %llu does not belong to this volume.\n", (unsigned long long)i);
+            return -1;
+        }
+        if (st->lens[i] < st->block_size) {
+            printf("Device %llu is smaller than one block.\n", (unsigned long long)i);
+            return -1;
+        }
+        check_checksum(st, member, i, "The superblock of device %llu has a bad checksum %#llx.");
+        if (st->lens[i] / st->block_size < member_blocks)
+            member_blocks = st->lens[i] / st->block_size;
+    }
+    st->stripe_unit = ASSOOFS_STRIPE_UNIT(st->sb);
+    st->nblocks = ASSOOFS_STRIPE_CAPACITY(member_blocks, st->stripe_unit, st->ndevices);
+    if (st->sb->blocks_count > st->nblocks &&
+        report(st, "Superblock blocks_count %llu is larger than the device (%llu blocks).", st->sb->blocks_count, st->nblocks))
+        st->sb->blocks_count = st->nblocks; // Lo que hubiera en los bloques perdidos se descarta al revisar los inodos
+    if (ASSOOFS_BLOCKS_COUNT(st->sb) < st->nblocks)
+        st->nblocks = ASSOOFS_BLOCKS_COUNT(st->sb); // Un dispositivo ampliado con el volumen sin crecer
+    st->bitmap = st->sb->version >= ASSOOFS_BITMAP_VERSION;
+    if (!st->bitmap && st->nblocks > ASSOOFS_BITMAP_CAPACITY(st->sb)) {
+        /* free_blocks solo cubre 64 bloques, lo de detras no se puede usar */
+        if (report(st, "Superblock blocks_count %llu is larger than the free block bitmap (%llu blocks).", st->nblocks, ASSOOFS_BITMAP_CAPACITY(st->sb)))
+            st->sb->blocks_count = ASSOOFS_BITMAP_CAPACITY(st->sb);
+        st->nblocks = ASSOOFS_BITMAP_CAPACITY(st->sb);
+    }
+    if (st->nblocks <= ASSOOFS_ROOTDIR_BLOCK_NUMBER) {
+        printf("The device is too small for %llu byte blocks.\n", (unsigned long long)st->block_size);
+        return -1;
+    }
+    /* Sin un mapa de bits que cubra el volumen no se sabe donde acaban los bloques fijos */
+    if (st->bitmap && (st->sb->bitmap_block <= ASSOOFS_LAST_RESERVED_BLOCK || st->sb->bitmap_blocks == 0 ||
+                       st->sb->bitmap_block + st->sb->bitmap_blocks > st->nblocks ||
+                       st->sb->bitmap_block + st->sb->bitmap_blocks < st->sb->bitmap_block ||
+                       st->nblocks > ASSOOFS_BITMAP_CAPACITY(st->sb))) {
+        printf("The free space bitmap (%llu blocks at %llu) does not cover the volume.\n",
+               (unsigned long long)st->sb->bitmap_blocks, (unsigned long long)st->sb->bitmap_block);
+        return -1;
+    }
+    st->used_blocks = calloc(1, (st->nblocks + 7) / 8);
+    st->meta_blocks = calloc(1, (st->nblocks + 7) / 8);
+    if (st->used_blocks == NULL || st->meta_blocks == NULL) {
+        printf("Could not allocate the block bitmaps for %llu blocks.\n", (unsigned long long)st->nblocks);
+        return -1;
+    }
+    set_block(st->meta_blocks, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); // Su suma ya se ha comprobado con la de los demas dispositivos
+    st->store = get_block(st, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    st->blockmap = st->sb->version >= ASSOOFS_BLOCKMAP_VERSION;
+    st->max_file_size = st->blockmap ? ASSOOFS_BLOCKMAP_ENTRIES(st->meta_size) * st->block_size : st->block_size;
+
+    max_inodes = ASSOOFS_MAX_INODES(st->meta_size);
+    st->ninodes = st->sb->inodes_count;
+    if (st->ninodes > max_inodes) {
+        st->ninodes = max_inodes; // Sin reparar tampoco se lee fuera del almacen
+        if (report(st, "Superblock inodes_count %llu exceeds the inode store (%llu).", st->sb->inodes_count, max_inodes))
+            st->sb->inodes_count = max_inodes;
+    }
+
+    printf("Superblock checked: version %llu, %llu inodes.\n",
+           (unsigned long long)st->sb->version, (unsigned long long)st->ninodes);
+    return 0;
+}
+
+/* Un bloque se puede asignar si existe, no es de los fijos y nadie lo ha reclamado antes */
+static int block_is_claimable(struct fsck_state *st, uint64_t block) {
+    return block > ASSOOFS_INODESTORE_BLOCK_NUMBER &&
+           block < st->nblocks &&
+           !test_block(st->used_blocks, block);
+}
+
+/* Un bloque de directorio se puede leer si esta dentro del volumen, aunque este mal sin reparar */
+static int block_in_volume(struct fsck_state *st, uint64_t block) {
+    return block > ASSOOFS_INODESTORE_BLOCK_NUMBER &&
+           block < st->nblocks;
+}
+
+/* Cada entrada del mapa de un fichero es un hueco o un bloque propio; las malas se convierten en huecos */
+static void check_blockmap(struct fsck_state *st, struct assoofs_inode_info *inode) {
+    uint64_t *map = get_block(st, inode->data_block_number);
+    uint64_t i;
+
+    check_meta_block(st, inode->data_block_number);
+    for (i = 0; i < ASSOOFS_BLOCKMAP_ENTRIES(st->meta_size); i++) {
+        if (map[i] == ASSOOFS_UNALLOCATED_BLOCK)
+            continue;
+        if (!block_is_claimable(st, map[i])) {
+            if (report(st, "File inode %llu maps an invalid or shared block %llu.", inode->inode_no, map[i]))
+                map[i] = ASSOOFS_UNALLOCATED_BLOCK;
+            continue;
+        }
+        set_block(st->used_blocks, map[i]);
+    }
+}
+
+static void check_inode_store(struct fsck_state *st) {
+    struct assoofs_inode_info *inode;
+    uint64_t i, j;
+
+    set_block(st->used_blocks, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    set_block(st->used_blocks, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (st->bitmap) {
+        for (i = 0; i < st->sb->bitmap_blocks; i++)
+            set_block(st->used_blocks, st->sb->bitmap_block + i); // Nadie los puede reclamar
+    }
+    check_meta_block(st, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+
+    for (i = 0; i < st->ninodes; i++) {
+        inode = &st->store[i];
+
+        if (inode->inode_no == 0 || inode->inode_no > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED ||
+            (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode))) {
+            if (report(st, "Inode slot %llu holds an invalid inode (%llu).", i, inode->inode_no)) {
+                drop_inode(st, i--);
+            }
+            continue;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (st->store[j].inode_no == inode->inode_no)
+                break;
+        }
+        if (j < i) {
+            if (report(st, "Inode %llu is duplicated in slot %llu.", inode->inode_no, i))
+                drop_inode(st, i--);
+            continue;
+        }
+
+        /* Los ficheros que aun no se han escrito o tienen el bloque perforado no ocupan bloque */
+        if (S_ISREG(inode->mode) && inode->data_block_number == ASSOOFS_UNALLOCATED_BLOCK) {
+            if (inode->file_size > st->max_file_size &&
+                report(st, "File inode %llu has size %llu larger than the maximum.", inode->inode_no, inode->file_size))
+                inode->file_size = st->max_file_size;
+            continue;
+        }
+
+        if (!block_is_claimable(st, inode->data_block_number)) {
+            if (report(st, "Inode %llu has an invalid or shared data block %llu.", inode->inode_no, inode->data_block_number))
+                drop_inode(st, i--);
+            continue;
+        }
+        set_block(st->used_blocks, inode->data_block_number);
+
+        if (S_ISDIR(inode->mode)) {
+            if (inode->dir_children_count > ASSOOFS_DIR_RECORDS_PER_BLOCK(st->meta_size) &&
+                report(st, "Directory inode %llu claims %llu children.", inode->inode_no, inode->dir_children_count))
+                inode->dir_children_count = ASSOOFS_DIR_RECORDS_PER_BLOCK(st->meta_size);
+        } else {
+            if (st->blockmap)
+                check_blockmap(st, inode);
+            if (inode->file_size > st->max_file_size &&
+                report(st, "File inode %llu has size %llu larger than the maximum.", inode->inode_no, inode->file_size))
+                inode->file_size = st->max_file_size;
+        }
+    }
+
+    printf("Inode store checked.\n");
+}
+
+static void check_directory(struct fsck_state *st, struct assoofs_inode_info *dir, int depth) {
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_inode_info *child;
+    uint64_t i;
+
+    if (!block_in_volume(st, dir->data_block_number))
+        return; // Ya se ha denunciado al revisar el almacen
+    record = get_block(st, dir->data_block_number);
+    check_meta_block(st, dir->data_block_number);
+    for (i = 0; i < dir->dir_children_count && i < ASSOOFS_DIR_RECORDS_PER_BLOCK(st->meta_size); i++) {
+        child = NULL;
+        if (memchr(record[i].filename, '\0', ASSOOFS_FILENAME_MAXLEN) != NULL && record[i].filename[0] != '\0' &&
+            valid_inode_no(record[i].inode_no))
+            child = find_inode(st, record[i].inode_no);
+
+        if (child == NULL || child->inode_no == ASSOOFS_ROOTDIR_INODE_NUMBER || is_referenced(st, child->inode_no)) {
+            if (report(st, "Directory inode %llu has a bad entry at position %llu.", dir->inode_no, i)) {
+                dir->dir_children_count--;
+                record[i] = record[dir->dir_children_count];
+                memset(&record[dir->dir_children_count], 0, sizeof(*record));
+                i--;
+            }
+            continue;
+        }
+
+        st->referenced |= 1ULL << (child->inode_no - 1);
+        if (S_ISDIR(child->mode) && depth < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+            check_directory(st, child, depth + 1);
+    }
+}
+
+/* Los inodos que no cuelgan de ningun directorio se reenganchan en la raiz como "#<inodo>" */
+static void check_connectivity(struct fsck_state *st, struct assoofs_inode_info *root) {
+    struct assoofs_dir_record_entry *record;
+    uint64_t i;
+
+    if (!block_in_volume(st, root->data_block_number)) {
+        printf("The root directory block is invalid, unreachable inodes can not be reconnected.\n");
+        return;
+    }
+    record = get_block(st, root->data_block_number);
+
+    for (i = 0; i < st->ninodes; i++) {
+        /* Los numeros invalidos ya se han denunciado al revisar el almacen */
+        if (!valid_inode_no(st->store[i].inode_no) || st->store[i].inode_no == ASSOOFS_ROOTDIR_INODE_NUMBER ||
+            is_referenced(st, st->store[i].inode_no))
+            continue;
+
+        if (root->dir_children_count >= ASSOOFS_DIR_RECORDS_PER_BLOCK(st->meta_size)) {
+            st->errors++;
+            printf("Inode %llu is unreachable and the root directory is full.\n", (unsigned long long)st->store[i].inode_no);
+            continue;
+        }
+        if (report(st, "Inode %llu is unreachable, reconnecting to / (slot %llu).", st->store[i].inode_no, i)) {
+            record += root->dir_children_count;
+            memset(record, 0, sizeof(*record));
+            snprintf(record->filename, ASSOOFS_FILENAME_MAXLEN, "#%llu", (unsigned long long)st->store[i].inode_no);
+            record->inode_no = st->store[i].inode_no;
+            st->referenced |= 1ULL << (record->inode_no - 1);
+            root->dir_children_count++;
+            record = get_block(st, root->data_block_number);
+            if (S_ISDIR(st->store[i].mode))
+                check_directory(st, &st->store[i], 1);
+        }
+    }
+
+    printf("Directory tree checked.\n");
+}
+
+static void check_free_blocks(struct fsck_state *st) {
+    uint64_t expected = 0, bits, i, b, block, wrong = 0, first_wrong = 0;
+    unsigned char *map;
+
+    if (!st->bitmap) {
+        for (i = 0; i < st->nblocks; i++)
+            if (!test_block(st->used_blocks, i))
+                expected |= 1ULL << i;
+        if (st->sb->free_blocks != expected &&
+            report(st, "Free block bitmap %#llx does not match the used blocks (expected %#llx).", st->sb->free_blocks, expected))
+            st->sb->free_blocks = expected;
+        printf("Free block bitmap checked.\n");
+        return;
+    }
+
+    /* Cada bit tiene que decir libre si el bloque esta dentro del volumen y nadie lo usa, los de detras de blocks_count ocupados */
+    bits = ASSOOFS_BITMAP_BITS(st->meta_size);
+    for (i = 0; i < st->sb->bitmap_blocks; i++) {
+        check_meta_block(st, st->sb->bitmap_block + i);
+        map = get_block(st, st->sb->bitmap_block + i);
+        for (b = 0; b < bits; b++) {
+            block = i * bits + b;
+            if (test_block(map, b) == (block < st->nblocks && !test_block(st->used_blocks, block)))
+                continue;
+            if (wrong++ == 0)
+                first_wrong = block;
+            if (st->repair)
+                map[b / 8] ^= 1 << (b % 8);
+        }
+    }
+    if (wrong)
+        report(st, "Free block bitmap has %llu wrong bits, the first for block %llu.", wrong, first_wrong);
+
+    printf("Free block bitmap checked.\n");
+}
+
+/* Modo scrub: se ejecuta junto al sistema montado sin quitarle E/S ni CPU */
+static void lower_priority(void) {
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+        perror("Could not lower the scrub priority");
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        perror("Could not set the idle I/O class");
+}
+
+/* Abre y mapea los dispositivos del volumen; sin striping es uno solo */
+static int open_devices(struct fsck_state *st, char **paths) {
+    uint64_t i;
+    off_t len;
+    int fd;
+
+    for (i = 0; i < st->ndevices; i++) {
+        /* Para reparar se abre en exclusiva: un dispositivo de bloques montado da EBUSY y no se escribe bajo el kernel */
+        fd = open(paths[i], st->repair ? O_RDWR | O_EXCL : O_RDONLY);
+        if (fd == -1 && errno == EBUSY) {
+            printf("%s is in use (mounted?), refusing to repair. Unmount it or check it with -n or -s.\n", paths[i]);
+            return -1;
+        }
+        if (fd == -1) {
+            perror("Error opening the device");
+            return -1;
+        }
+        st->fds[i] = fd;
+
+        /* Los dispositivos de bloques devuelven tamaño 0 en stat, se pregunta con lseek */
+        len = lseek(fd, 0, SEEK_END);
+        if (len == (off_t)-1) {
+            perror("Error reading the device size");
+            return -1;
+        }
+        if (len < ASSOOFS_MIN_BLOCK_SIZE * (ASSOOFS_ROOTDIR_BLOCK_NUMBER + 1)) {
+            printf("The device %s is too small to hold an assoofs filesystem.\n", paths[i]);
+            return -1;
+        }
+
+        st->images[i] = mmap(NULL, len, st->repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (st->images[i] == MAP_FAILED) {
+            st->images[i] = NULL;
+            perror("Error mapping the device");
+            return -1;
+        }
+        st->lens[i] = len;
+    }
+    return 0;
+}
+
+static void close_devices(struct fsck_state *st) {
+    uint64_t i;
+
+    for (i = 0; i < st->ndevices; i++) {
+        if (st->images[i] != NULL) {
+            if (st->repair && st->fixed && msync(st->images[i], st->lens[i], MS_SYNC) == -1)
+                perror("Error writing the repairs");
+            munmap(st->images[i], st->lens[i]);
+        }
+        if (st->fds[i] != -1)
+            close(st->fds[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct fsck_state st;
+    struct assoofs_inode_info *root;
+    int opt, scrub = 0;
+    uint64_t i;
+
+    memset(&st, 0, sizeof(st));
+    while ((opt = getopt(argc, argv, "nys")) != -1) {
+        switch (opt) {
+        case 'n':
+            st.repair = 0;
+            break;
+        case 'y':
+            st.repair = 1;
+            break;
+        case 's':
+            scrub = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    st.ndevices = argc - optind;
+    if (st.ndevices < 1 || st.ndevices > ASSOOFS_MAX_STRIPE_DEVICES || (scrub && st.repair)) {
+        printf("Usage: fsck.assoofs [-n | -y | -s] <device> [device...]\n");
+        printf("  -n  check only (default)\n  -y  repair every error found (the device must not be mounted)\n  -s  read-only scrub of a mounted filesystem at idle priority\n");
+        printf("  A striped volume needs all its devices, in the order given to mkassoofs.\n");
+        return FSCK_ERROR;
+    }
+
+    if (scrub)
+        lower_priority();
+
+    for (i = 0; i < st.ndevices; i++)
+        st.fds[i] = -1;
+    if (open_devices(&st, &argv[optind])) {
+        close_devices(&st);
+        return FSCK_ERROR;
+    }
+    st.sb = (struct assoofs_super_block_info *)st.images[0]; // El superbloque esta al principio, sea cual sea el tam de bloque
+
+    do {
+        if (check_superblock(&st)) {
+            st.errors = -1;
+            break;
+        }
+
+        check_inode_store(&st);
+
+        root = find_inode(&st, ASSOOFS_ROOTDIR_INODE_NUMBER);
+        if (root == NULL || !S_ISDIR(root->mode)) {
+            printf("Root directory inode is missing, can not continue.\n");
+            st.errors = -1;
+            break;
+        }
+
+        check_directory(&st, root, 0);
+        check_connectivity(&st, root);
+        check_free_blocks(&st);
+        write_checksums(&st);
+    } while (0);
+
+    close_devices(&st);
+    free(st.used_blocks);
+    free(st.meta_blocks);
+
+    if (st.errors < 0)
+        return FSCK_ERROR;
+    printf("%d errors found, %d fixed.\n", st.errors, st.fixed);
+    if (st.errors > st.fixed)
+        return FSCK_UNCORRECTED;
+    return st.fixed ? FSCK_NONDESTRUCT : FSCK_OK;
+}
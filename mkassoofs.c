@@ -6,28 +6,71 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
+#define BITMAP_BLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1) /* El mapa de bits va detras de la raiz, el fichero de bienvenida detras */
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
 
-static int write_superblock(int fd) {
+/* Dispositivos del volumen y geometria del striping */
+struct volume {
+    int fds[ASSOOFS_MAX_STRIPE_DEVICES];
+    uint64_t ndevices;
+    uint64_t stripe_unit;
+    uint64_t stripe_id;
+    uint64_t block_size;
+    uint64_t blocks_count;
+    uint64_t bitmap_blocks;   /* Bloques del mapa de bits, cubren blocks_count o lo pedido con -g */
+    uint64_t welcome_map;     /* Mapa de bloques y bloque de datos del fichero de bienvenida, tras el mapa de bits */
+    uint64_t welcome_data;
+};
+
+/* Deja el dispositivo que guarda el bloque logico block apuntando a el y devuelve su descriptor */
+static int seek_block(const struct volume *vol, uint64_t block) {
+    int fd = vol->fds[ASSOOFS_STRIPE_MEMBER(block, vol->stripe_unit, vol->ndevices)];
+    off_t offset = ASSOOFS_STRIPE_OFFSET(block, vol->stripe_unit, vol->ndevices) * vol->block_size;
+
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        perror("Error seeking in the device");
+        return -1;
+    }
+    return fd;
+}
+
+/* Cada dispositivo lleva en su bloque 0 el superbloque con su posicion (index), el que se usa al montar es el del 0 */
+static int write_superblock(int fd, const struct volume *vol, uint64_t index) {
     struct assoofs_super_block_info sb = {
-        .version = 1,
+        .version = ASSOOFS_VERSION,
         .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+        .block_size = vol->block_size,
         .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
+        .blocks_count = vol->blocks_count,
+        .stripe_devices = vol->ndevices,
+        .stripe_unit = vol->stripe_unit,
+        .stripe_index = index,
+        .stripe_id = vol->stripe_id,
+        .bitmap_block = BITMAP_BLOCK_NUMBER,
+        .bitmap_blocks = vol->bitmap_blocks,
     };
+    uint64_t block_size = vol->block_size;
     ssize_t ret;
+    char *block;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    /* El superbloque ocupa el bloque 0 entero, lo que sobra va a ceros */
+    block = calloc(1, block_size);
+    if (block == NULL) {
+        printf("Could not allocate a %llu byte block.\n", (unsigned long long)block_size);
+        return -1;
+    }
+    memcpy(block, &sb, sizeof(sb));
+    ret = write(fd, block, block_size);
+    free(block);
+    if (ret != block_size) {
+        printf("Bytes written [%d] are not equal to the block size.\n", (int)ret);
         return -1;
     }
 
-    printf("Super block written succesfully.\n");
+    printf("Super block of device %llu written succesfully.\n", (unsigned long long)index);
     return 0;
 }
 
@@ -36,7 +79,8 @@ static int write_root_inode(int fd) {
 
     struct assoofs_inode_info root_inode;
 
-    root_inode.mode = S_IFDIR;
+    memset(&root_inode, 0, sizeof(root_inode)); // uid y gid de root (0)
+    root_inode.mode = S_IFDIR | 0755;
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
     root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
     root_inode.dir_children_count = 1;
@@ -52,7 +96,7 @@ static int write_root_inode(int fd) {
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
+static int write_welcome_inode(int fd, const struct assoofs_inode_info *i, uint64_t block_size) {
     off_t nbytes;
     ssize_t ret;
 
@@ -63,7 +107,7 @@ static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
     }
     printf("welcomefile inode written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
+    nbytes = block_size - (sizeof(*i) * 2);
     ret = lseek(fd, nbytes, SEEK_CUR);
     if (ret == (off_t)-1) {
         printf("The padding bytes are not written properly.\n");
@@ -74,7 +118,7 @@ static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
+int write_dirent(int fd, const struct assoofs_dir_record_entry *record, uint64_t block_size) {
     ssize_t nbytes = sizeof(*record), ret;
 
     ret = write(fd, record, nbytes);
@@ -84,7 +128,7 @@ int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
     }
     printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
+    nbytes = block_size - sizeof(*record);
     ret = lseek(fd, nbytes, SEEK_CUR);
     if (ret == (off_t)-1) {
         printf("Writing the padding for rootdirectory children datablock has failed.\n");
@@ -94,6 +138,64 @@ int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
     return 0;
 }
 
+/* Mapa de bloques del fichero de bienvenida: su unico bloque de datos es el primero, el resto son huecos */
+int write_blockmap(int fd, uint64_t data_block, uint64_t block_size) {
+    uint64_t *map;
+    ssize_t ret;
+
+    map = calloc(1, block_size);
+    if (map == NULL) {
+        printf("Could not allocate a %llu byte block.\n", (unsigned long long)block_size);
+        return -1;
+    }
+    map[0] = data_block;
+
+    ret = write(fd, map, block_size);
+    free(map);
+    if (ret != block_size) {
+        printf("Writing the welcomefile block map has failed.\n");
+        return -1;
+    }
+    printf("welcomefile block map written succesfully.\n");
+    return 0;
+}
+
+/* Mapa de bits de bloques libres: libres los que hay detras del fichero de bienvenida, ocupados los que no caben en el volumen */
+static int write_bitmap(const struct volume *vol) {
+    uint64_t bits = ASSOOFS_BITMAP_BITS(ASSOOFS_CHECKSUM_OFFSET(vol->block_size));
+    uint64_t i, b, block;
+    unsigned char *map;
+    ssize_t ret;
+    int fd;
+
+    map = malloc(vol->block_size);
+    if (map == NULL) {
+        printf("Could not allocate a %llu byte block.\n", (unsigned long long)vol->block_size);
+        return -1;
+    }
+    for (i = 0; i < vol->bitmap_blocks; i++) {
+        memset(map, 0, vol->block_size);
+        for (b = 0; b < bits; b++) {
+            block = i * bits + b;
+            if (block > vol->welcome_data && block < vol->blocks_count)
+                map[b / 8] |= 1 << (b % 8);
+        }
+        if ((fd = seek_block(vol, BITMAP_BLOCK_NUMBER + i)) == -1)
+            break;
+        ret = write(fd, map, vol->block_size);
+        if (ret != vol->block_size) {
+            printf("Writing the free space bitmap has failed.\n");
+            break;
+        }
+    }
+    free(map);
+    if (i < vol->bitmap_blocks)
+        return -1;
+
+    printf("Free space bitmap (%llu blocks) written succesfully.\n", (unsigned long long)vol->bitmap_blocks);
+    return 0;
+}
+
 int write_block(int fd, char *block, size_t len) {
     ssize_t ret;
 
@@ -106,16 +208,87 @@ int write_block(int fd, char *block, size_t len) {
     return 0;
 }
 
+/* Pone en los ultimos 4 bytes del bloque que empieza en offset el crc32c del resto, una vez escrito todo su contenido */
+static int write_checksum(int fd, off_t offset, uint64_t block_size) {
+    uint64_t meta_size = ASSOOFS_CHECKSUM_OFFSET(block_size);
+    uint32_t crc;
+    char *block;
+    ssize_t ret;
+
+    block = calloc(1, block_size);
+    if (block == NULL) {
+        printf("Could not allocate a %llu byte block.\n", (unsigned long long)block_size);
+        return -1;
+    }
+    ret = pread(fd, block, meta_size, offset);
+    if (ret != meta_size) {
+        perror("Error reading back a metadata block");
+        free(block);
+        return -1;
+    }
+    crc = assoofs_crc32c(~0U, block, meta_size);
+    free(block);
+
+    if (pwrite(fd, &crc, sizeof(crc), offset + meta_size) != sizeof(crc)) {
+        perror("Error writing a metadata checksum");
+        return -1;
+    }
+    return 0;
+}
+
+/* Sumas de los bloques de metadatos que crea mkassoofs, el bloque de datos del fichero de bienvenida no lleva */
+static int write_checksums(const struct volume *vol) {
+    uint64_t i, block;
+    int fd;
+
+    /* Desde el superbloque hasta el mapa del fichero de bienvenida todos son de metadatos, incluido el mapa de bits */
+    for (block = ASSOOFS_SUPERBLOCK_BLOCK_NUMBER; block <= vol->welcome_map; block++) {
+        fd = vol->fds[ASSOOFS_STRIPE_MEMBER(block, vol->stripe_unit, vol->ndevices)];
+        if (write_checksum(fd, ASSOOFS_STRIPE_OFFSET(block, vol->stripe_unit, vol->ndevices) * vol->block_size, vol->block_size))
+            return -1;
+    }
+
+    /* Las copias del superbloque de los demas dispositivos tambien se comprueban al montar */
+    for (i = 1; i < vol->ndevices; i++) {
+        if (write_checksum(vol->fds[i], 0, vol->block_size))
+            return -1;
+    }
+
+    printf("Metadata checksums written succesfully.\n");
+    return 0;
+}
+
+/* Identificador del volumen para reconocer a sus dispositivos al montar */
+static uint64_t new_stripe_id(void) {
+    uint64_t id = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1) {
+        if (read(fd, &id, sizeof(id)) != sizeof(id))
+            id = 0;
+        close(fd);
+    }
+    if (id == 0)
+        id = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    return id;
+}
+
 int main(int argc, char *argv[])
 {
-    int fd;
+    int fd, opt, force = 0;
     ssize_t ret;
+    off_t len;
+    uint64_t i, member_blocks = UINT64_MAX, max_blocks = 0;
+    struct volume vol = {
+        .stripe_unit = 1,
+        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+    };
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
     
     struct assoofs_inode_info welcome = {
-        .mode = S_IFREG,
+        .mode = S_IFREG | 0644,
         .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
         .file_size = sizeof(welcomefile_body),
     };
     
@@ -124,37 +297,132 @@ int main(int argc, char *argv[])
         .inode_no = WELCOMEFILE_INODE_NUMBER,
     };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    while ((opt = getopt(argc, argv, "b:u:g:f")) != -1) {
+        switch (opt) {
+        case 'b':
+            vol.block_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'u':
+            vol.stripe_unit = strtoull(optarg, NULL, 0);
+            break;
+        case 'g':
+            max_blocks = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            force = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    vol.ndevices = argc - optind;
+    if (vol.ndevices < 1 || vol.ndevices > ASSOOFS_MAX_STRIPE_DEVICES) {
+        printf("Usage: mkassoofs [-f] [-b block_size] [-u stripe_unit] [-g max_blocks] <device> [device...]\n");
+        printf("  -g leaves room in the free space bitmap to grow the volume up to max_blocks blocks (default the device size).\n");
+        printf("  -f formats with a block size bigger than the page size, the volume can only be mounted on a machine with bigger pages.\n");
+        printf("  With several devices the volume is striped across them, stripe_unit blocks at a time (default 1).\n");
+        printf("  Up to %d devices; mount the first one with -o devices=<second>:<third>...\n", ASSOOFS_MAX_STRIPE_DEVICES);
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("Error opening the device");
+    if (!ASSOOFS_VALID_BLOCK_SIZE(vol.block_size)) {
+        printf("The block size must be a power of two between %d and %d bytes.\n", ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE);
+        return -1;
+    }
+    /* El modulo no monta bloques mas grandes que una pagina (sb_set_blocksize falla), solo tiene sentido para otra maquina */
+    if (vol.block_size > (uint64_t)getpagesize()) {
+        printf("The block size %llu is bigger than the page size %d, this kernel can not mount the volume.\n", (unsigned long long)vol.block_size, getpagesize());
+        if (!force) {
+            printf("Use -f to format it anyway.\n");
+            return -1;
+        }
+    }
+    if (vol.stripe_unit == 0 || vol.stripe_unit > ASSOOFS_MAX_STRIPE_UNIT) {
+        printf("The stripe unit must be between 1 and %d blocks.\n", ASSOOFS_MAX_STRIPE_UNIT);
         return -1;
     }
 
+    for (i = 0; i < vol.ndevices; i++)
+        vol.fds[i] = -1;
     ret = 1;
     do {
-        if (write_superblock(fd))
+        for (i = 0; i < vol.ndevices; i++) {
+            fd = open(argv[optind + i], O_RDWR);
+            if (fd == -1) {
+                perror("Error opening the device");
+                break;
+            }
+            vol.fds[i] = fd;
+
+            /* Los dispositivos de bloques devuelven tamaño 0 en stat, se pregunta con lseek */
+            len = lseek(fd, 0, SEEK_END);
+            if (len == (off_t)-1) {
+                perror("Error reading the device size");
+                break;
+            }
+            if (len / vol.block_size < member_blocks)
+                member_blocks = len / vol.block_size; // Todos los dispositivos se usan hasta el tam del mas pequeño
+        }
+        if (i < vol.ndevices)
             break;
 
-        if (write_root_inode(fd))
+        /* El mapa de bits se dimensiona con el volumen (o con lo que se quiera crecer) y lo que sobra de su ultimo bloque */
+        vol.blocks_count = ASSOOFS_STRIPE_CAPACITY(member_blocks, vol.stripe_unit, vol.ndevices);
+        if (max_blocks < vol.blocks_count)
+            max_blocks = vol.blocks_count;
+        vol.bitmap_blocks = (max_blocks + ASSOOFS_BITMAP_BITS(ASSOOFS_CHECKSUM_OFFSET(vol.block_size)) - 1) /
+                            ASSOOFS_BITMAP_BITS(ASSOOFS_CHECKSUM_OFFSET(vol.block_size));
+        vol.welcome_map = BITMAP_BLOCK_NUMBER + vol.bitmap_blocks;
+        vol.welcome_data = vol.welcome_map + 1;
+        welcome.data_block_number = vol.welcome_map;
+        if (vol.blocks_count <= vol.welcome_data) {
+            printf("The devices are too small, the volume needs at least %llu blocks of %llu bytes.\n",
+                   (unsigned long long)vol.welcome_data + 1, (unsigned long long)vol.block_size);
+            break;
+        }
+        vol.stripe_id = new_stripe_id();
+
+        /* Cada bloque logico se escribe en el dispositivo y la posicion que le tocan (ASSOOFS_STRIPE_OFFSET) */
+        if ((fd = seek_block(&vol, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER)) == -1 || write_superblock(fd, &vol, 0))
+            break;
+
+        if ((fd = seek_block(&vol, ASSOOFS_INODESTORE_BLOCK_NUMBER)) == -1 || write_root_inode(fd))
             break;
         
-        if (write_welcome_inode(fd, &welcome))
+        if (write_welcome_inode(fd, &welcome, vol.block_size))
+            break;
+
+        if ((fd = seek_block(&vol, ASSOOFS_ROOTDIR_BLOCK_NUMBER)) == -1 || write_dirent(fd, &record, vol.block_size))
+            break;
+
+        if (write_bitmap(&vol))
             break;
 
-        if (write_dirent(fd, &record))
+        if ((fd = seek_block(&vol, vol.welcome_map)) == -1 || write_blockmap(fd, vol.welcome_data, vol.block_size))
             break;
         
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+        if ((fd = seek_block(&vol, vol.welcome_data)) == -1 || write_block(fd, welcomefile_body, welcome.file_size))
+            break;
+
+        /* El resto de dispositivos solo llevan la copia del superbloque que los identifica */
+        for (i = 1; i < vol.ndevices; i++) {
+            if (lseek(vol.fds[i], 0, SEEK_SET) == (off_t)-1 || write_superblock(vol.fds[i], &vol, i))
+                break;
+        }
+        if (i < vol.ndevices)
+            break;
+
+        if (write_checksums(&vol))
             break;
 
         ret = 0;
     } while (0);
 
-    close(fd);
+    for (i = 0; i < vol.ndevices; i++) {
+        if (vol.fds[i] != -1)
+            close(vol.fds[i]);
+    }
     return ret;
 }
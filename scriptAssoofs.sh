@@ -34,6 +34,8 @@ done
 #sudo su
 #dd bs=4096 count=100 if=/dev/zero of=image
 #./mkassoofs image
+#(con otro tam de bloque: dd bs=1024 count=64 if=/dev/zero of=image && ./mkassoofs -b 1024 image)
+#modprobe libcrc32c     (insmod no carga dependencias, crc32c() esta en libcrc32c)
 #insmod assoofs.ko
 #mkdir mnt
 #mount -o loop -t assoofs image mnt
@@ -44,5 +46,32 @@ done
 #make clean
 #make
 #./mkassoofs image
+#modprobe libcrc32c
 #insmod assoofs.ko
 #mount -o loop -t assoofs image mnt/
+
+#Comprobar y reparar la imagen (desmontada)
+#./fsck.assoofs -y image
+#Scrub de solo lectura con el sistema montado
+#./fsck.assoofs -s /dev/loop0
+
+#Crecer sin desmontar: mkassoofs -g deja sitio en el mapa de bits (sin -g solo hasta llenar su ultimo bloque)
+#dd bs=4096 count=32 if=/dev/zero of=image && ./mkassoofs -g 262144 image
+#truncate -s 1G image
+#losetup -c /dev/loop0
+#./assoofs-resize mnt
+
+#Capturar una traza y reproducirla sobre una imagen nueva
+#mount -o loop,trace -t assoofs image mnt
+#cp /sys/kernel/debug/assoofs/loop0/trace trace.bin
+#./mkassoofs image2 && mount -o loop -t assoofs image2 mnt2
+#./assoofs-replay trace.bin mnt2      (-f para ir lo mas rapido posible)
+
+#Volumen repartido entre varios dispositivos (striping), aqui tres de 64 MiB
+#for i in 1 2 3; do truncate -s 64M disk$i && losetup /dev/loop$i disk$i; done
+#./mkassoofs -u 1 /dev/loop1 /dev/loop2 /dev/loop3
+#mount -t assoofs -o devices=/dev/loop2:/dev/loop3 /dev/loop1 mnt
+#./fsck.assoofs /dev/loop1 /dev/loop2 /dev/loop3
+#Escalado: escribir lo mismo con uno y con tres dispositivos (cada fichero cabe en su mapa de bloques, un solo nivel: 2 MiB como mucho con bloques de 4 KiB, mas da EFBIG)
+#time (for i in $(seq 1 60); do dd if=/dev/zero of=mnt/f$i bs=64K count=32 2>/dev/null; done)
+#umount mnt && ./mkassoofs /dev/loop1 && mount -t assoofs /dev/loop1 mnt    (y se repite el time)